@@ -2,6 +2,6 @@
 
 file_to_copy="fs"
 
-for dir in tests/test1 tests/test2 tests/test3 tests/test4; do
+for dir in tests/test*; do
     cp "$file_to_copy" "$dir"
 done
\ No newline at end of file
@@ -1,869 +1,4604 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(SEEK_HOLE)
+#define HAVE_PUNCH_HOLE 1
+#endif
 #include "fs-sim.h"
 
-// Global variables
-static Superblock superblock;
-static char buffer[1024];
-static char* current_disk = NULL;
-static int current_dir_inode = 0;  // Root directory inode index
+// Layout derived from the geometry in fs-sim.h. In the classic layout the
+// state and type flags are bit 7 of byte-wide inode fields and block 0 holds
+// the superblock; these all fold to the constants the format was written
+// around, so that build runs the same code it always did.
+#if FS_CLASSIC
+#define INODE_FLAG 0x80
+#define SUPERBLOCK_BLOCKS 1
+typedef int8_t InodeRef;           // Inode index in the name index, -1 for none
+typedef uint8_t ExtentField;
+#else
+#define INODE_FLAG 0x80000000u
+#define SUPERBLOCK_BLOCKS ((int)(sizeof(Superblock) / FS_BLOCK_SIZE))
+typedef int32_t InodeRef;
+typedef uint32_t ExtentField;
+#endif
+#define FIELD_MASK ((int)(INODE_FLAG - 1))
+#define ROOT_PARENT (FS_INODE_COUNT + 1)  // dir_parent of entries in the root
+#define FIRST_DATA_BLOCK SUPERBLOCK_BLOCKS
+#define DATA_BLOCKS (FS_BLOCK_COUNT - FIRST_DATA_BLOCK)
+#define MAX_FILE_BLOCKS (DATA_BLOCKS < FIELD_MASK ? DATA_BLOCKS : FIELD_MASK)
+// Longest single transfer, which sizes the transfer buffer
+#define MAX_RANGE_BLOCKS (MAX_FILE_BLOCKS < (1 << 20) / FS_BLOCK_SIZE ? \
+                          MAX_FILE_BLOCKS : (1 << 20) / FS_BLOCK_SIZE)
+#define DISK_BYTES ((off_t)FS_BLOCK_COUNT * FS_BLOCK_SIZE)
+#define BITMAP_WORDS (FS_BLOCK_COUNT / 64)
+#define INODE_WORDS ((FS_INODE_COUNT + 63) / 64)
+#define SUPERBLOCK_WORDS ((int)(sizeof(Superblock) / 8))
+
+// Block cache: an LRU of cache_capacity data blocks in front of the disk.
+// Writes are held back until the block is evicted, or until sync, remount
+// or exit, and then go out together with the dirty blocks next to them.
+// A read that carries on where the last read of the same file ended also
+// fetches the blocks after it. Slots that hold no block sit at the tail,
+// so they are reused first. A capacity of 0 sends all data-block I/O
+// straight to the disk.
+#define READ_AHEAD_BLOCKS 8      // Most blocks fetched past a sequential read
+#define WRITE_COMBINE_BLOCKS 16  // Most dirty blocks written back at once
+typedef struct {
+    int block;        // Cached block number, -1 when the slot is empty
+    int dirty;
+    int prev;         // LRU neighbours, most recently used at cache_head
+    int next;
+    char data[FS_BLOCK_SIZE];
+} CacheEntry;
+
+// Clean-unmount marker, stored just past the last block of the image. It
+// carries a checksum of the superblock it was written for, and is removed
+// again while the disk is mounted.
+typedef struct {
+    char magic[8];
+    uint64_t checksum;
+} CleanMarker;
+
+static const char clean_magic[8] = "FSCLEAN";
+
+// Journal record header. It is followed by count entries, each the index
+// of a changed 8-byte word of the superblock (in the classic layout the
+// bitmap is words 0-1 and inode i is word i + 2) and its new contents. The
+// checksum covers the whole record with the checksum field zeroed.
+typedef struct {
+    char magic[8];
+    uint64_t checksum;
+    uint32_t seq;
+    uint32_t count;
+} JournalHeader;
+
+static const char journal_magic[8] = "FSJRNL1";
+
+// Snapshot state of a block
+#define SNAPSHOT_CLEAN 0      // No data worth keeping, not changed yet
+#define SNAPSHOT_NEEDED 1     // Holds file data, not preserved yet
+#define SNAPSHOT_KEPT 2       // Original contents are in snapshot_data
+#define SNAPSHOT_CHANGED 3    // No data worth keeping, changed since
+
+// Word indexes take one byte while the superblock has at most 256 words, as
+// in the classic layout, and four bytes otherwise
+#define JOURNAL_INDEX_SIZE (SUPERBLOCK_WORDS <= 256 ? 1 : 4)
+#define JOURNAL_ENTRY_SIZE (JOURNAL_INDEX_SIZE + 8)
+#define JOURNAL_BUFFER_SIZE (32 * 1024)
+#define JOURNAL_GROUP 16                  // Records per group commit
+#define JOURNAL_CHECKPOINT (64 * 1024)    // Journal size that triggers a checkpoint
+
+#define INDEX_BUCKETS 256
+
+// Allocation policy used by fs_create and fs_resize relocation
+typedef enum {
+    ALLOC_FIRST_FIT,   // Lowest run that fits
+    ALLOC_BEST_FIT,    // Smallest run that fits, lowest on ties
+    ALLOC_NEXT_FIT     // First fit starting where the last allocation ended
+} AllocPolicy;
+
+static const char *alloc_policy_names[] = {"first", "best", "next"};
+
+// On-disk formats. Version 1 images hold only contiguous files. Version 2
+// adds extent-mapped files, whose inode start_block is the number of a map
+// block with EXTENT_MAPPED set. The superblock has no spare byte for a
+// version number, so each map block carries one. An image without mapped
+// files is still version 1, and legacy builds reject the flagged inodes of
+// a version 2 image as inconsistent rather than misreading them. Version 3
+// is any other geometry: its superblock starts with a header giving the
+// version and geometry, and its map blocks carry version 3 as well.
+#define FORMAT_EXTENTS 2
+#define FORMAT_GEOMETRY 3
+#define EXTENT_MAPPED INODE_FLAG
+
+#if FS_CLASSIC
+#define MAP_VERSION FORMAT_EXTENTS
+#else
+#define MAP_VERSION FORMAT_GEOMETRY
+#endif
+
+typedef struct {
+    ExtentField start;
+    ExtentField count;
+} Extent;
+
+#define MAP_EXTENTS ((FS_BLOCK_SIZE - 8) / (int)sizeof(Extent))
+// Extents a file can have, bounded by its map block
+#define EXTENT_SLOTS (MAP_EXTENTS < MAX_FILE_BLOCKS ? MAP_EXTENTS : MAX_FILE_BLOCKS)
+
+// Contents of a map block: the extents of a file in logical order
+typedef struct {
+    char magic[3];
+    uint8_t version;
+#if FS_CLASSIC
+    uint8_t count;
+    uint8_t reserved[3];
+#else
+    uint32_t count;
+#endif
+    Extent extent[MAP_EXTENTS];
+} ExtentBlock;
+
+static const char extent_magic[3] = {'F', 'S', 'X'};
+
+#if !FS_CLASSIC
+static const char geometry_magic[8] = "FSGEOM3";
+#endif
+
+// File extent as seen by fs_defrag
+typedef struct {
+    int inode_idx;
+    int start_block;
+    int size;
+} FileInfo;
+
+// Submission and completion rings of an io_uring instance, fd -1 if none
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *sqes;
+    void *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} IoRing;
+
+// A queued block transfer: count blocks from src to dst, or zeros to dst
+// when src is -1
+typedef struct {
+    int dst;
+    int src;
+    int count;
+} BlockTransfer;
+
+#define IO_QUEUE_SIZE 254
+
+// A cached directory walk: the directory the first len bytes of path lead
+// to from base. Valid while generation matches the context's.
+#define PATH_CACHE_SIZE 64
+#define PATH_CACHE_KEY 56      // Longest directory part that is cached
+
+typedef struct {
+    unsigned generation;
+    int base;
+    int dir;
+    int len;
+    char path[PATH_CACHE_KEY];
+} PathEntry;
+
+// Counters reported by T and --stats. Commands are counted by letter as
+// they are dispatched; the timing columns are only kept with --stats.
+// Threads sharing a context bump the counters with STAT_ADD.
+typedef struct {
+    unsigned long commands[26];
+    unsigned long command_ns[26];
+    unsigned long syscalls;      // Reads, writes, syncs and truncations of the disk and journal
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long blocks_zeroed;
+    unsigned long blocks_moved;  // Data blocks relocated by defrag and resize
+    unsigned long blocks_punched; // Zero-filled blocks released as holes instead
+    unsigned long hole_reads;    // Blocks read as holes without any I/O
+    unsigned long inode_scans;   // Index entries and in-use words visited by lookups and free-inode searches
+    unsigned long alloc_probes;  // Free runs examined by block allocation
+    unsigned long path_hits;     // Directory parts of paths found in the path cache
+    unsigned long path_walks;    // Directory parts of paths walked component by component
+} FsStats;
+
+#define STAT_ADD(fs, field, n) __atomic_fetch_add(&(fs)->stats.field, (n), __ATOMIC_RELAXED)
+
+// State of one simulated file system: the mounted disk and everything
+// cached from it. A context belongs to one command stream at a time, so
+// contexts on different disks can be driven from different threads.
+struct FsContext {
+    FILE *out;                   // Listings and reports
+    FILE *err;                   // Diagnostics
+    Superblock superblock;
+    char buffer[MAX_RANGE_BLOCKS * FS_BLOCK_SIZE]; // Transfer buffer; B, R and W use its first block
+    char *current_disk;
+    int current_dir_inode;       // Root directory inode index
+    int disk_fd;                 // Descriptor of current_disk, held for the whole mount
+    int superblock_dirty;        // In-memory superblock differs from the disk
+    int hold_flush;              // Batch mode defers write-through flushes
+    char *disk_map;              // Mapping of current_disk when use_mmap is set
+    int superblock_consistent;   // In-memory superblock is known to pass check_consistency
+
+    // Blocks whose on-disk bytes are stale and must read back as zeros. With
+    // lazy_zero, freed blocks are only flagged here: reads of a flagged block
+    // are served as zeros, and a write clears the flag. Flagged blocks that
+    // belong to a file are zeroed on sync and unmount. Since the flags are not
+    // stored on disk, a lazy mount flags every free block.
+    uint8_t stale_block[FS_BLOCK_COUNT];
+
+    // With use_holes, blocks known to be holes in the image, one bit per
+    // block as in the free-block list. Found with SEEK_HOLE on mount and set
+    // when a zero-fill punches a hole; any write clears them. Reads of
+    // holes are served as zeros without touching the image.
+    uint64_t hole_map[BITMAP_WORDS];
+    int punch_failed;            // The image cannot punch holes, so zeros are written
+
+    int cache_capacity;
+    CacheEntry *cache;
+    int cache_slot[FS_BLOCK_COUNT]; // Slot caching each block, -1 if none
+    int cache_head;
+    int cache_tail;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long cache_read_ahead;
+    char read_ahead_data[READ_AHEAD_BLOCKS * FS_BLOCK_SIZE];
+    char combine_data[WRITE_COMBINE_BLOCKS * FS_BLOCK_SIZE];
+
+    // First block after the last read of each file, updated with relaxed
+    // atomics as reads of one file may run at once. Only a hint; -1 until
+    // the file is read, and reset whenever its inode changes hands.
+    int read_next[FS_INODE_COUNT];
+    FsStats stats;
+
+    // Name index: inodes hashed by (parent, name) key, chained through
+    // index_next in ascending inode order so a lookup returns the same inode a
+    // linear scan of the table would. Each parent value, up to ROOT_PARENT, keeps its
+    // children as an ascending sibling list with a cached count. Rebuilt on
+    // mount, maintained by create/delete.
+    uint64_t inode_key[FS_INODE_COUNT];
+    InodeRef index_head[INDEX_BUCKETS];
+    InodeRef index_next[FS_INODE_COUNT];
+    InodeRef first_child[ROOT_PARENT + 1];
+    InodeRef next_sibling[FS_INODE_COUNT];
+    int child_count[ROOT_PARENT + 1];
+
+    // The in-use and directory flags of every inode, bit i % 64 of word
+    // i / 64, kept with the index. Table scans test 64 inodes at a time
+    // here instead of striding through the inode records.
+    uint64_t inode_used[INODE_WORDS];
+    uint64_t inode_dir[INODE_WORDS];
+
+    // Directory walks of path arguments. Only walks that succeed are
+    // stored. Names are not unique and a lookup takes the lowest inode, so
+    // a new directory can also change where a walk leads: the cache is
+    // dropped, by moving to the next generation, whenever a directory is
+    // added or removed or the index is rebuilt.
+    PathEntry path_cache[PATH_CACHE_SIZE];
+    unsigned path_generation;
+
+    // Work space of delete_tree: the inodes of the subtree being deleted,
+    // which of them are already listed, and the blocks their files hold
+    InodeRef tree_list[FS_INODE_COUNT];
+    uint64_t tree_listed[INODE_WORDS];
+    uint64_t tree_blocks[BITMAP_WORDS];
+
+    // Extents of extent-mapped files, loaded on mount and written back to
+    // their map block whenever they change. extent_count is 0 for contiguous
+    // files and for maps that could not be loaded.
+    Extent extent[FS_INODE_COUNT][EXTENT_SLOTS];
+    ExtentField extent_count[FS_INODE_COUNT];
+
+    // Longest run of free blocks, or -1 when the free-block list changed since
+    // it was last measured. Lets hopeless allocations fail without a search.
+    int largest_free_run;
+
+    AllocPolicy alloc_policy;
+    int next_fit_cursor;
+
+    // Background compaction, set with G. Between commands, while the
+    // fragmentation score is above compact_threshold, compact_step slides
+    // files down by up to compact_budget blocks. A file larger than that
+    // waits for compact_credit, the budget saved up over earlier steps, to
+    // cover it. With a budget set, a create that finds no contiguous run
+    // compacts just enough to make one instead of failing.
+    int compact_budget;
+    int compact_threshold;
+    int compact_credit;
+
+    // I/O batching for move plans. While io_batching is set, disk_move and
+    // disk_zero only queue their transfers; io_batch_flush submits every
+    // queued read, waits for them, and then submits every write and
+    // zero-fill together. A transfer touching blocks that a queued one
+    // writes, and any other disk access, flushes the queue first, so the
+    // outcome is the same as issuing the transfers in order.
+    IoRing ring;
+    int io_batching;
+    BlockTransfer io_queue[IO_QUEUE_SIZE];
+    int io_queued;
+    int io_staged;               // Blocks of io_staging claimed by queued moves
+    char io_staging[MAX_RANGE_BLOCKS * FS_BLOCK_SIZE];
+
+    // Metadata journal, a sidecar file next to the disk image. Each metadata
+    // command buffers a record of the superblock words it changed. Records
+    // are written and synced in groups, and folded back into the superblock
+    // (a checkpoint) on sync, remount and exit, or once the journal is large.
+    int journal_fd;              // -1 when not journaling
+    char *journal_path;
+    Superblock journal_base;     // On-disk superblock with the journal applied
+    char journal_buffer[JOURNAL_BUFFER_SIZE];
+    size_t journal_buffered;
+    int journal_pending;         // Records in journal_buffer
+    uint32_t journal_seq;        // Sequence number of the next record
+    off_t journal_size;
+    int journal_unsynced;        // Records written since the last fdatasync
+    int journal_barrier;         // Blocks moved since the data was last synced
+
+    // Copy-on-write snapshot of the mounted disk. Taking one copies the
+    // superblock and the stale flags; a data block the snapshot still
+    // needs is copied into snapshot_data just before it is first
+    // overwritten, moved over, or freed. Rollback puts the preserved
+    // blocks back, returns every other block that changed to free and
+    // zeroed, and restores the superblock.
+    int snapshot_active;
+    Superblock snapshot_superblock;
+    int snapshot_consistent;
+    char snapshot_stale[FS_BLOCK_COUNT];
+    char snapshot_state[FS_BLOCK_COUNT]; // SNAPSHOT_* for each block
+    char (*snapshot_data)[FS_BLOCK_SIZE];
+
+    // Locks, always taken in this order. meta_lock guards the superblock and
+    // everything derived from it: data-block reads and writes hold it
+    // shared, anything that changes metadata or the mount holds it
+    // exclusively. Under a shared meta_lock, inode_lock keeps reads and
+    // writes of one file apart, and cache_lock serializes use of the block
+    // cache, so I/O to different files only contends there. path_lock
+    // guards path_cache and is never held with another lock but meta_lock.
+    pthread_rwlock_t meta_lock;
+    pthread_rwlock_t inode_lock[FS_INODE_COUNT];
+    pthread_mutex_t cache_lock;
+    pthread_mutex_t path_lock;
+};
+
+// Options, set from the command line before any context is created
+static int write_through = 0;      // Flush the superblock after every metadata change
+static int use_mmap = 0;           // Map the disk image instead of using pread/pwrite
+static int trust_clean = 0;        // Skip check_consistency when a valid clean marker is found
+static int lazy_zero = 0;          // Defer zeroing of freed blocks instead of writing zeros
+static int batch_mode = 0;         // Load the whole command file and coalesce before running
+static int use_io_uring = 0;       // Batch block moves and zero-fills through io_uring
+static int use_journal = 0;        // Journal metadata changes next to each disk
+static int use_extents = 0;        // Map files through extents when they do not fit contiguously
+static int use_holes = 0;          // Punch holes for zeroed blocks and skip reads of holes
+static int cache_blocks = 0;       // Block cache capacity of each context
+static int collect_stats = 0;      // Time every command and print the counters at exit
+static AllocPolicy default_alloc_policy = ALLOC_FIRST_FIT;
 
 // Helper functions declarations
-static int get_block_bit(int block_num);
-static void set_block_bit(int block_num, int value);
-static int find_free_inode(void);
-static int find_contiguous_blocks(int size);
-static void mark_blocks(int start, int size, int mark);
-static int compare_inode_names(const char* name1, const char* name2);
-static void write_superblock(void);
-static int check_consistency(void);
-static void clean_name(char* name);
+static int get_block_bit(FsContext *fs, int block_num);
+static uint64_t bitmap_word(FsContext *fs, int word_idx);
+static void store_bitmap_word(FsContext *fs, int word_idx, uint64_t word);
+static int next_block(FsContext *fs, int from, int used);
+static int find_free_inode(FsContext *fs);
+static int find_contiguous_blocks(FsContext *fs, int size);
+static int parse_alloc_policy(const char *name);
+static void mark_blocks(FsContext *fs, int start, int size, int mark);
+static uint64_t name_key(int parent, const char* name);
+static int index_parent(const Inode *inode);
+static void index_insert(FsContext *fs, int inode_idx);
+static void index_remove(FsContext *fs, int inode_idx);
+static void index_rebuild(FsContext *fs);
+static int find_inode(FsContext *fs, int dir, const char* name, int want_dir);
+static int step_dir(FsContext *fs, int dir, const char *name);
+static int resolve_dir(FsContext *fs, const char *path, int len);
+static int split_path(FsContext *fs, const char *path, char name[6]);
+static int inode_is_dir(FsContext *fs, int inode_idx);
+static uint64_t inode_slots(int w);
+static void write_superblock(FsContext *fs);
+static void flush_superblock(FsContext *fs);
+static int compare_keys(const void *a, const void *b);
+static int compare_files(const void *a, const void *b);
+static int geometry_matches(const Superblock *superblock);
+static void format_superblock(Superblock *superblock);
+static int check_consistency(FsContext *fs);
+static uint64_t superblock_checksum(FsContext *fs);
+static int take_clean_marker(FsContext *fs, int fd);
+static void put_clean_marker(FsContext *fs, uint64_t checksum);
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+static int journal_replay(Superblock *superblock, const char *path, off_t *valid_end);
+static void journal_open(FsContext *fs, const char *disk_name, int records, off_t valid_end);
+static void journal_close(FsContext *fs);
+static void journal_record(FsContext *fs);
+static void journal_commit(FsContext *fs, int durable);
+static void journal_checkpoint(FsContext *fs);
+static void journal_write_ahead(FsContext *fs);
+static void end_update(FsContext *fs);
+static void sync_disk_data(FsContext *fs);
+static void snapshot_preserve(FsContext *fs, int start, int count);
+static void snapshot_discard(FsContext *fs);
+static void take_snapshot(FsContext *fs);
+static void rollback_snapshot(FsContext *fs);
+static void disk_read(FsContext *fs, int block, void *buf, int count);
+static void disk_write(FsContext *fs, int block, const void *buf, int count);
+static void disk_zero(FsContext *fs, int start, int count);
+static int range_is_hole(FsContext *fs, int start, int count);
+static void set_holes(FsContext *fs, int start, int count, int hole);
+static int punch_hole(FsContext *fs, int start, int count);
+static void find_holes(FsContext *fs);
+static void disk_move(FsContext *fs, int dst, int src, int count);
+static char *map_disk(int fd);
+static int ring_setup(IoRing *ring, unsigned entries);
+static void ring_teardown(IoRing *ring);
+static int ring_run(IoRing *ring, int fd, const BlockTransfer *transfers, const int *staged,
+                    int count, int reads, char *staging, unsigned long *enters);
+static void io_batch_begin(FsContext *fs);
+static void io_batch_end(FsContext *fs);
+static void io_batch_flush(FsContext *fs);
+static void io_queue_transfer(FsContext *fs, int dst, int src, int count);
+static void unmount_disk(FsContext *fs);
+static void release_disk(FsContext *fs, uint64_t checksum);
+static int cache_init(FsContext *fs, int capacity);
+static void cache_read(FsContext *fs, int block, void *buf, int count);
+static void cache_prefetch(FsContext *fs, int block, int count);
+static int cache_flush_run(FsContext *fs, int block, int end);
+static void cache_write(FsContext *fs, int block, const void *buf, int count);
+static void cache_discard(FsContext *fs, int start, int count);
+static void cache_writeback(FsContext *fs, int start, int count);
+static void cache_zero(FsContext *fs, int start, int count);
+static void cache_move(FsContext *fs, int dst, int src, int count);
+static void release_blocks(FsContext *fs, int start, int count);
+static void move_blocks(FsContext *fs, int dst, int src, int count);
+static void zero_stale_blocks(FsContext *fs, int include_free);
+static void settle_disk(FsContext *fs);
+static int count_free_blocks(FsContext *fs);
+static int take_free_block(FsContext *fs);
+static int map_block(FsContext *fs, int inode_idx, int block_num, int *run);
+static void load_extent_maps(FsContext *fs, int fd, const char *map);
+static void store_extent_map(FsContext *fs, int inode_idx);
+static int allocate_extents(FsContext *fs, int inode_idx, int count);
+static void truncate_extents(FsContext *fs, int inode_idx, int new_size);
+static void finish_extent_map(FsContext *fs, int inode_idx);
+static void release_file(FsContext *fs, int inode_idx);
+static int find_file_range(FsContext *fs, const char *path, int block_num, int count);
+static void read_file_blocks(FsContext *fs, int inode_idx, int block_num, int count, char *data);
+static void read_ahead(FsContext *fs, int inode_idx, int block_num);
+static void write_file_blocks(FsContext *fs, int inode_idx, int block_num, int count, const char *data);
+static void set_buffer(FsContext *fs, const char *data, int len);
+static void mount_disk(FsContext *fs, char *new_disk_name);
+static void create_entry(FsContext *fs, const char *path, int size);
+static void delete_entry(FsContext *fs, const char *path, int inode_idx);
+static void delete_tree(FsContext *fs, int dir);
+static void add_block_range(uint64_t *map, int start, int count);
+static void list_dir(FsContext *fs);
+static void resize_file(FsContext *fs, const char *path, int new_size);
+static void defrag_disk(FsContext *fs);
+static int file_at_block(FsContext *fs, int block);
+static int compact_blocks(FsContext *fs, int budget, int need, int *done);
+static void compact_step(FsContext *fs);
+static int free_extents(FsContext *fs, int *largest);
+static int fragmentation_score(FsContext *fs);
+static void report_frag(FsContext *fs);
+static void change_dir(FsContext *fs, const char *path);
 
 // Helper function implementations
-static int find_free_inode() {
-    for (int i = 0; i < 126; i++) {
-        if (!(superblock.inode[i].used_size & 0x80)) {
-            return i;
+// Slots past FS_INODE_COUNT read as free, so a full table runs into one
+static int find_free_inode(FsContext *fs) {
+    for (int w = 0; w < INODE_WORDS; w++) {
+        STAT_ADD(fs, inode_scans, 1);
+        uint64_t free_slots = ~fs->inode_used[w];
+        if (free_slots) {
+            int i = w * 64 + __builtin_ctzll(free_slots);
+            return i < FS_INODE_COUNT ? i : -1;
         }
     }
     return -1;
 }
 
-static int find_contiguous_blocks(int size) {
+// Hop from free run to free run rather than testing every start, and pick
+// one according to alloc_policy. A failed search has seen every run, so it
+// records the largest one. Callers always allocate what is found, so a
+// successful next-fit search also advances the cursor.
+static int find_contiguous_blocks(FsContext *fs, int size) {
     if (size <= 0) return 0;
-    
-    for (int start = 1; start <= 127 - size + 1; start++) {
-        int available = 1;
-        for (int i = 0; i < size && available; i++) {
-            if (get_block_bit(start + i)) {
-                available = 0;
+    if (fs->largest_free_run != -1 && size > fs->largest_free_run) return -1;
+
+    int found = -1;
+    int found_len = 0;
+    int largest = 0;
+    int start = next_block(fs, FIRST_DATA_BLOCK, 0);
+    while (start < FS_BLOCK_COUNT) {
+        int end = next_block(fs, start, 1);
+        int len = end - start;
+        if (len > largest) largest = len;
+        STAT_ADD(fs, alloc_probes, 1);
+
+        if (len >= size) {
+            if (fs->alloc_policy == ALLOC_FIRST_FIT) {
+                return start;
+            } else if (fs->alloc_policy == ALLOC_BEST_FIT) {
+                if (found == -1 || len < found_len) {
+                    found = start;
+                    found_len = len;
+                }
+            } else {
+                int from = start > fs->next_fit_cursor ? start : fs->next_fit_cursor;
+                if (end - from >= size) {
+                    fs->next_fit_cursor = from + size;
+                    return from;
+                }
+                // Nothing past the cursor may fit, so remember where to wrap to
+                if (found == -1) found = start;
             }
         }
-        if (available) {
-            return start;
+        start = next_block(fs, end, 0);
+    }
+
+    if (found == -1) {
+        fs->largest_free_run = largest;
+    } else if (fs->alloc_policy == ALLOC_NEXT_FIT) {
+        fs->next_fit_cursor = found + size;
+    }
+    return found;
+}
+
+static int parse_alloc_policy(const char *name) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, alloc_policy_names[i]) == 0) {
+            return i;
         }
     }
     return -1;
 }
 
-static void mark_blocks(int start, int size, int mark) {
-    for (int i = start; i < start + size; i++) {
-        int byte_idx = i / 8;
-        int bit_idx = i % 8;
-        
-        if (mark) {
-            superblock.free_block_list[byte_idx] |= (1 << bit_idx);
-        } else {
-            superblock.free_block_list[byte_idx] &= ~(1 << bit_idx);
-        }
+static void mark_blocks(FsContext *fs, int start, int size, int mark) {
+    int end = start + size > FS_BLOCK_COUNT ? FS_BLOCK_COUNT : start + size;
+    while (start < end) {
+        int word_idx = start / 64;
+        int bits = (end < (word_idx + 1) * 64 ? end : (word_idx + 1) * 64) - start;
+        uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << (start % 64);
+        uint64_t word = bitmap_word(fs, word_idx);
+        store_bitmap_word(fs, word_idx, mark ? word | mask : word & ~mask);
+        start += bits;
     }
+    fs->largest_free_run = -1;
 }
 
-static void clean_name(char* name) {
-    // Trim leading and trailing spaces
-    int start = 0;
-    int end = strlen(name) - 1;
-    
-    while(start < 5 && name[start] == ' ') start++;
-    while(end >= 0 && name[end] == ' ') end--;
-    
-    if (start > end) {
-        name[0] = '\0';
-        return;
+// Pack a name into the low 40 bits and the parent index above it. Names are
+// compared up to their first space or NUL, so both end the packed name. Two
+// inodes get the same key exactly when they share a parent and a name.
+static uint64_t name_key(int parent, const char* name) {
+    uint64_t key = 0;
+    for (int i = 0; i < 5 && name[i] != '\0' && name[i] != ' '; i++) {
+        key |= (uint64_t)(uint8_t)name[i] << (8 * i);
     }
-    
-    // Shift characters to remove leading spaces
-    int j = 0;
-    for(int i = start; i <= end && j < 5; i++) {
-        name[j++] = name[i];
+    return key | (uint64_t)(parent & FIELD_MASK) << 40;
+}
+
+// Parent list an inode is kept on. Only a corrupt inode of a wide geometry
+// can name a parent past ROOT_PARENT; it joins the invalid FS_INODE_COUNT
+// instead, which check_consistency rejects, like any other bad parent.
+static int index_parent(const Inode *inode) {
+    int parent = inode->dir_parent & FIELD_MASK;
+    return parent > ROOT_PARENT ? FS_INODE_COUNT : parent;
+}
+
+static int key_bucket(uint64_t key) {
+    return (int)((key * 0x9E3779B97F4A7C15ULL) >> 56) & (INDEX_BUCKETS - 1);
+}
+
+static void index_insert(FsContext *fs, int inode_idx) {
+    Inode *node = &fs->superblock.inode[inode_idx];
+    uint64_t key = name_key(node->dir_parent, node->name);
+    fs->inode_key[inode_idx] = key;
+
+    InodeRef *link = &fs->index_head[key_bucket(key)];
+    while (*link != -1 && *link < inode_idx) {
+        link = &fs->index_next[(int)*link];
+    }
+    fs->index_next[inode_idx] = *link;
+    *link = inode_idx;
+
+    int parent = index_parent(node);
+    link = &fs->first_child[parent];
+    while (*link != -1 && *link < inode_idx) {
+        link = &fs->next_sibling[(int)*link];
+    }
+    fs->next_sibling[inode_idx] = *link;
+    *link = inode_idx;
+    fs->child_count[parent]++;
+
+    uint64_t bit = 1ULL << (inode_idx % 64);
+    fs->inode_used[inode_idx / 64] |= bit;
+    if (node->dir_parent & INODE_FLAG) {
+        fs->inode_dir[inode_idx / 64] |= bit;
+        fs->path_generation++;
     }
-    name[j] = '\0';
 }
 
-static int compare_inode_names(const char* name1, const char* name2) {
-    // 6 >5 so the name will always end with '\0' to make this method safe
-    char temp1[6] = {0};
-    char temp2[6] = {0};
-    
-    // Copy and trim both names
-    strncpy(temp1, name1, 5);
-    strncpy(temp2, name2, 5);
-    
-    for (int i = 4; i >= 0; i--) {
-        if (temp1[i] == ' ') temp1[i] = '\0';
-        if (temp2[i] == ' ') temp2[i] = '\0';
+static void index_remove(FsContext *fs, int inode_idx) {
+    InodeRef *link = &fs->index_head[key_bucket(fs->inode_key[inode_idx])];
+    while (*link != -1 && *link != inode_idx) {
+        link = &fs->index_next[(int)*link];
     }
-    
-    return strcmp(temp1, temp2) == 0;
+    if (*link == inode_idx) {
+        *link = fs->index_next[inode_idx];
+    }
+
+    int parent = index_parent(&fs->superblock.inode[inode_idx]);
+    link = &fs->first_child[parent];
+    while (*link != -1 && *link != inode_idx) {
+        link = &fs->next_sibling[(int)*link];
+    }
+    if (*link == inode_idx) {
+        *link = fs->next_sibling[inode_idx];
+        fs->child_count[parent]--;
+    }
+
+    if (inode_is_dir(fs, inode_idx)) fs->path_generation++;
+    fs->inode_used[inode_idx / 64] &= ~(1ULL << (inode_idx % 64));
+    fs->inode_dir[inode_idx / 64] &= ~(1ULL << (inode_idx % 64));
 }
 
-static void set_block_bit(int block_num, int value) {
-    int byte_idx = block_num / 8;
-    int bit_idx = block_num % 8;
-    if (value) {
-        superblock.free_block_list[byte_idx] |= (1 << bit_idx);
-    } else {
-        superblock.free_block_list[byte_idx] &= ~(1 << bit_idx);
+static void index_rebuild(FsContext *fs) {
+    memset(fs->index_head, -1, sizeof(fs->index_head));
+    memset(fs->first_child, -1, sizeof(fs->first_child));
+    memset(fs->child_count, 0, sizeof(fs->child_count));
+    memset(fs->inode_used, 0, sizeof(fs->inode_used));
+    memset(fs->inode_dir, 0, sizeof(fs->inode_dir));
+    fs->path_generation++;
+    for (int i = 0; i < FS_INODE_COUNT; i++) {
+        if (fs->superblock.inode[i].used_size & INODE_FLAG) {
+            index_insert(fs, i);
+        }
+    }
+}
+
+// Look up name in directory dir. want_dir is 1 for directories, 0 for
+// files and -1 for either. Returns the inode index or -1.
+static int find_inode(FsContext *fs, int dir, const char* name, int want_dir) {
+    uint64_t key = name_key(dir, name);
+    for (int i = fs->index_head[key_bucket(key)]; i != -1; i = fs->index_next[i]) {
+        STAT_ADD(fs, inode_scans, 1);
+        if (fs->inode_key[i] == key && (want_dir == -1 || inode_is_dir(fs, i) == want_dir)) {
+            return i;
+        }
     }
+    return -1;
+}
+
+static int inode_is_dir(FsContext *fs, int inode_idx) {
+    return (fs->inode_dir[inode_idx / 64] >> (inode_idx % 64)) & 1;
+}
+
+// Inode slots of word w that exist in the table
+static uint64_t inode_slots(int w) {
+    int past = FS_INODE_COUNT - w * 64;
+    return past >= 64 ? ~0ULL : (1ULL << past) - 1;
 }
 
-static int get_block_bit(int block_num) {
+static int get_block_bit(FsContext *fs, int block_num) {
     int byte_idx = block_num / 8;
     int bit_idx = block_num % 8;
-    return (superblock.free_block_list[byte_idx] & (1 << bit_idx)) != 0;
+    return (fs->superblock.free_block_list[byte_idx] & (1 << bit_idx)) != 0;
 }
 
-static void write_superblock() {
-    FILE *disk = fopen(current_disk, "r+b");
-    if (disk) {
-        fwrite(&superblock, sizeof(Superblock), 1, disk);
-        fclose(disk);
+// The free-block list viewed as two 64-bit words: block b is bit b % 64 of
+// word b / 64, matching the byte/bit layout used by get_block_bit.
+static uint64_t bitmap_word(FsContext *fs, int word_idx) {
+    uint64_t word = 0;
+    for (int i = 7; i >= 0; i--) {
+        word = word << 8 | (uint8_t)fs->superblock.free_block_list[word_idx * 8 + i];
     }
+    return word;
 }
 
-static int check_consistency() {
-    // Check 1: Verify free inodes
-    for (int i = 0; i < 126; i++) {
-        if (!(superblock.inode[i].used_size & 0x80)) {
-            if (superblock.inode[i].start_block != 0) {
-                return 1;
-            }
+static void store_bitmap_word(FsContext *fs, int word_idx, uint64_t word) {
+    for (int i = 0; i < 8; i++) {
+        fs->superblock.free_block_list[word_idx * 8 + i] = (char)(word >> (8 * i));
+    }
+}
+
+// Index of the first block at or after from that is used (used = 1) or
+// free (used = 0), or FS_BLOCK_COUNT if there is none.
+static int next_block(FsContext *fs, int from, int used) {
+    while (from < FS_BLOCK_COUNT) {
+        uint64_t word = bitmap_word(fs, from / 64);
+        if (!used) word = ~word;
+        word &= ~0ULL << (from % 64);
+        if (word) {
+            return (from & ~63) + __builtin_ctzll(word);
         }
+        from = (from & ~63) + 64;
     }
+    return FS_BLOCK_COUNT;
+}
 
-    // Check 2: Valid start block and size for files
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            !(superblock.inode[i].dir_parent & 0x80)) {
-            int size = superblock.inode[i].used_size & 0x7F;
-            int start = superblock.inode[i].start_block;
-            
-            if (start < 1 || start > 127 || 
-                start + size - 1 < 1 || start + size - 1 > 127) {
-                return 2;
-            }
+// Free data blocks; the blocks before FIRST_DATA_BLOCK always hold the
+// superblock
+static int count_free_blocks(FsContext *fs) {
+    int free_blocks = 0;
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        uint64_t word = ~bitmap_word(fs, w);
+        if (w * 64 < FIRST_DATA_BLOCK) {
+            int reserved = FIRST_DATA_BLOCK - w * 64;
+            word &= reserved >= 64 ? 0 : ~0ULL << reserved;
         }
+        free_blocks += __builtin_popcountll(word);
     }
+    return free_blocks;
+}
 
-    // Check 3: Directory attributes
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            (superblock.inode[i].dir_parent & 0x80)) {
-            if (superblock.inode[i].start_block != 0 || 
-                (superblock.inode[i].used_size & 0x7F) != 0) {
-                return 3;
-            }
+// Allocate the lowest free block, or return -1
+static int take_free_block(FsContext *fs) {
+    int block = next_block(fs, FIRST_DATA_BLOCK, 0);
+    if (block == FS_BLOCK_COUNT) return -1;
+    mark_blocks(fs, block, 1, 1);
+    return block;
+}
+
+// Physical block holding block block_num of a file, with in run the number
+// of the file's blocks stored contiguously from there. Returns -1 with run
+// 0 past the end of a bad map.
+static int map_block(FsContext *fs, int inode_idx, int block_num, int *run) {
+    const Inode *inode = &fs->superblock.inode[inode_idx];
+    if (!(inode->start_block & EXTENT_MAPPED)) {
+        *run = (inode->used_size & FIELD_MASK) - block_num;
+        return inode->start_block + block_num;
+    }
+
+    for (int e = 0; e < (int)fs->extent_count[inode_idx]; e++) {
+        const Extent *extent = &fs->extent[inode_idx][e];
+        if (block_num < (int)extent->count) {
+            *run = extent->count - block_num;
+            return extent->start + block_num;
         }
+        block_num -= extent->count;
     }
+    *run = 0;
+    return -1;
+}
 
-    // Check 4: Parent directory validity
-    for (int i = 0; i < 126; i++) {
-        if (superblock.inode[i].used_size & 0x80) {
-            int parent = superblock.inode[i].dir_parent & 0x7F;
-            if (parent == 126) return 4;
-            if (parent != 127) {
-                if (parent < 0 || parent > 125) return 4;
-                if (!(superblock.inode[parent].used_size & 0x80) ||
-                    !(superblock.inode[parent].dir_parent & 0x80)) {
-                    return 4;
-                }
+// Load the map of every extent-mapped file. On mount the blocks are read
+// from the new disk's fd or mapping, as it is not switched over yet;
+// otherwise (fd -1) they come through the cache. A map that is not a valid
+// map of this format version loads as empty, which check_consistency rejects.
+static void load_extent_maps(FsContext *fs, int fd, const char *map) {
+    for (int i = 0; i < FS_INODE_COUNT; i++) {
+        const Inode *inode = &fs->superblock.inode[i];
+        int block = inode->start_block & FIELD_MASK;
+        fs->extent_count[i] = 0;
+        if (!(inode->used_size & INODE_FLAG) || (inode->dir_parent & INODE_FLAG) || 
+            !(inode->start_block & EXTENT_MAPPED) || block < FIRST_DATA_BLOCK || block >= FS_BLOCK_COUNT) {
+            continue;
+        }
+
+        ExtentBlock contents;
+        if (map) {
+            memcpy(&contents, map + (size_t)block * FS_BLOCK_SIZE, sizeof(contents));
+        } else if (fd == -1) {
+            cache_read(fs, block, &contents, 1);
+            if (fs->stale_block[block]) memset(&contents, 0, sizeof(contents));
+        } else {
+            STAT_ADD(fs, syscalls, 1);
+            STAT_ADD(fs, bytes_read, sizeof(contents));
+            if (pread(fd, &contents, sizeof(contents), (off_t)block * FS_BLOCK_SIZE) != sizeof(contents)) {
+                continue;
             }
         }
+        if (memcmp(contents.magic, extent_magic, sizeof(extent_magic)) != 0 ||
+            contents.version != MAP_VERSION || contents.count == 0 || contents.count > EXTENT_SLOTS) {
+            continue;
+        }
+
+        int valid = 1;
+        for (int e = 0; e < (int)contents.count; e++) {
+            const Extent *extent = &contents.extent[e];
+            valid = valid && extent->start >= FIRST_DATA_BLOCK && extent->start < FS_BLOCK_COUNT &&
+                    extent->count >= 1 && extent->count <= FS_BLOCK_COUNT - extent->start;
+        }
+        if (valid) {
+            memcpy(fs->extent[i], contents.extent, contents.count * sizeof(Extent));
+            fs->extent_count[i] = contents.count;
+        }
     }
+}
 
-    // Check 5: Unique names within directories
-    for (int dir = 0; dir < 126; dir++) {
-        if ((superblock.inode[dir].used_size & 0x80) && 
-            (superblock.inode[dir].dir_parent & 0x80)) {
-            for (int i = 0; i < 126; i++) {
-                for (int j = i + 1; j < 126; j++) {
-                    if ((superblock.inode[i].used_size & 0x80) &&
-                        (superblock.inode[j].used_size & 0x80) &&
-                        (superblock.inode[i].dir_parent & 0x7F) == dir &&
-                        (superblock.inode[j].dir_parent & 0x7F) == dir &&
-                        compare_inode_names(superblock.inode[i].name, 
-                                         superblock.inode[j].name)) {
-                        return 5;
-                    }
-                }
+static void store_extent_map(FsContext *fs, int inode_idx) {
+    ExtentBlock contents;
+    memset(&contents, 0, sizeof(contents));
+    memcpy(contents.magic, extent_magic, sizeof(extent_magic));
+    contents.version = MAP_VERSION;
+    contents.count = fs->extent_count[inode_idx];
+    memcpy(contents.extent, fs->extent[inode_idx], contents.count * sizeof(Extent));
+
+    int block = fs->superblock.inode[inode_idx].start_block & FIELD_MASK;
+    snapshot_preserve(fs, block, 1);
+    cache_write(fs, block, &contents, 1);
+    fs->stale_block[block] = 0;
+}
+
+// Add count blocks to the end of an extent-mapped file, first by growing
+// its last extent into free blocks right after it, then from the lowest
+// free runs. The caller has checked that enough blocks are free. Returns -1
+// when the file would need more extents than its map holds, having taken
+// only what fits; the caller truncates back to the old size.
+static int allocate_extents(FsContext *fs, int inode_idx, int count) {
+    Extent *extents = fs->extent[inode_idx];
+    int n = fs->extent_count[inode_idx];
+    if (n > 0) {
+        int end = extents[n - 1].start + extents[n - 1].count;
+        int grow = next_block(fs, end, 1) - end;
+        if (grow > count) grow = count;
+        mark_blocks(fs, end, grow, 1);
+        extents[n - 1].count += grow;
+        count -= grow;
+    }
+
+    for (int start = next_block(fs, FIRST_DATA_BLOCK, 0); count > 0 && start < FS_BLOCK_COUNT; ) {
+        if (n == EXTENT_SLOTS) break;
+        int end = next_block(fs, start, 1);
+        STAT_ADD(fs, alloc_probes, 1);
+        int take = end - start < count ? end - start : count;
+        mark_blocks(fs, start, take, 1);
+        extents[n].start = start;
+        extents[n].count = take;
+        n++;
+        count -= take;
+        start = next_block(fs, end, 0);
+    }
+    fs->extent_count[inode_idx] = n;
+    return count > 0 ? -1 : 0;
+}
+
+// Free the blocks of an extent-mapped file past its first new_size
+static void truncate_extents(FsContext *fs, int inode_idx, int new_size) {
+    Extent *extents = fs->extent[inode_idx];
+    int kept = 0;
+    int n = 0;
+    for (int e = 0; e < (int)fs->extent_count[inode_idx]; e++) {
+        int count = extents[e].count;
+        int keep = new_size - kept < count ? new_size - kept : count;
+        if (keep < count) {
+            mark_blocks(fs, extents[e].start + keep, count - keep, 0);
+            release_blocks(fs, extents[e].start + keep, count - keep);
+        }
+        extents[e].count = keep;
+        kept += keep;
+        if (keep > 0) n = e + 1;
+    }
+    fs->extent_count[inode_idx] = n;
+}
+
+// Write a changed map back, or turn a file whose map is down to one extent
+// back into a contiguous file and free the map block
+static void finish_extent_map(FsContext *fs, int inode_idx) {
+    Inode *inode = &fs->superblock.inode[inode_idx];
+    if (fs->extent_count[inode_idx] > 1) {
+        store_extent_map(fs, inode_idx);
+        return;
+    }
+
+    int block = inode->start_block & FIELD_MASK;
+    inode->start_block = fs->extent[inode_idx][0].start;
+    fs->extent_count[inode_idx] = 0;
+    mark_blocks(fs, block, 1, 0);
+    release_blocks(fs, block, 1);
+}
+
+// Free every block of a file, including the map of a mapped one
+static void release_file(FsContext *fs, int inode_idx) {
+    int start = fs->superblock.inode[inode_idx].start_block;
+    int size = fs->superblock.inode[inode_idx].used_size & FIELD_MASK;
+    if (!(start & EXTENT_MAPPED)) {
+        mark_blocks(fs, start, size, 0);
+        release_blocks(fs, start, size);
+        return;
+    }
+
+    for (int e = 0; e < (int)fs->extent_count[inode_idx]; e++) {
+        const Extent *extent = &fs->extent[inode_idx][e];
+        mark_blocks(fs, extent->start, extent->count, 0);
+        release_blocks(fs, extent->start, extent->count);
+    }
+    fs->extent_count[inode_idx] = 0;
+    if ((start & FIELD_MASK) != 0) {
+        mark_blocks(fs, start & FIELD_MASK, 1, 0);
+        release_blocks(fs, start & FIELD_MASK, 1);
+    }
+}
+
+// Block I/O on the mounted disk. With the mmap backend blocks are copied
+// straight out of the mapping; otherwise offsets are computed from the block
+// number, so no seek is needed and the descriptor is never reopened.
+static const char zero_blocks[MAX_RANGE_BLOCKS * FS_BLOCK_SIZE];
+
+static void disk_read(FsContext *fs, int block, void *buf, int count) {
+    if (fs->io_queued) io_batch_flush(fs);
+    if (use_holes && range_is_hole(fs, block, count)) {
+        STAT_ADD(fs, hole_reads, count);
+        memset(buf, 0, (size_t)count * FS_BLOCK_SIZE);
+        return;
+    }
+    STAT_ADD(fs, bytes_read, (unsigned long)count * FS_BLOCK_SIZE);
+    if (fs->disk_map) {
+        memcpy(buf, fs->disk_map + (size_t)block * FS_BLOCK_SIZE, (size_t)count * FS_BLOCK_SIZE);
+    } else {
+        STAT_ADD(fs, syscalls, 1);
+        if (pread(fs->disk_fd, buf, (size_t)count * FS_BLOCK_SIZE, (off_t)block * FS_BLOCK_SIZE) < 0) {
+            memset(buf, 0, (size_t)count * FS_BLOCK_SIZE);
+        }
+    }
+}
+
+static void disk_write(FsContext *fs, int block, const void *buf, int count) {
+    if (fs->io_queued) io_batch_flush(fs);
+    if (use_holes) set_holes(fs, block, count, 0);
+    STAT_ADD(fs, bytes_written, (unsigned long)count * FS_BLOCK_SIZE);
+    if (fs->disk_map) {
+        memcpy(fs->disk_map + (size_t)block * FS_BLOCK_SIZE, buf, (size_t)count * FS_BLOCK_SIZE);
+        return;
+    }
+    // Failures are silently ignored, as with a read-only disk
+    STAT_ADD(fs, syscalls, 1);
+    (void)!pwrite(fs->disk_fd, buf, (size_t)count * FS_BLOCK_SIZE, (off_t)block * FS_BLOCK_SIZE);
+}
+
+// Zeros go out as writes of a zeroed area, up to MAX_RANGE_BLOCKS at a time
+static void disk_zero(FsContext *fs, int start, int count) {
+    if (count <= 0) return;
+    STAT_ADD(fs, blocks_zeroed, count);
+    if (use_holes && punch_hole(fs, start, count) == 0) return;
+    if (fs->disk_map) {
+        STAT_ADD(fs, bytes_written, (unsigned long)count * FS_BLOCK_SIZE);
+        memset(fs->disk_map + (size_t)start * FS_BLOCK_SIZE, 0, (size_t)count * FS_BLOCK_SIZE);
+        return;
+    }
+    for (int done = 0; done < count; done += MAX_RANGE_BLOCKS) {
+        int n = count - done < MAX_RANGE_BLOCKS ? count - done : MAX_RANGE_BLOCKS;
+        if (fs->io_batching) {
+            io_queue_transfer(fs, start + done, -1, n);
+        } else {
+            disk_write(fs, start + done, zero_blocks, n);
+        }
+    }
+}
+
+// Copy count blocks from src to dst; the ranges may overlap
+static void disk_move(FsContext *fs, int dst, int src, int count) {
+    if (count <= 0 || dst == src) return;
+    if (use_holes) set_holes(fs, dst, count, 0);
+    if (count > MAX_RANGE_BLOCKS && !fs->disk_map) {
+        // Move in pieces, ordered so that no piece overwrites source blocks
+        // that a later one still has to read
+        for (int done = 0; done < count; done += MAX_RANGE_BLOCKS) {
+            int n = count - done < MAX_RANGE_BLOCKS ? count - done : MAX_RANGE_BLOCKS;
+            int offset = dst < src ? done : count - done - n;
+            disk_move(fs, dst + offset, src + offset, n);
+        }
+        return;
+    }
+    if (fs->io_batching) {
+        io_queue_transfer(fs, dst, src, count);
+        return;
+    }
+    if (fs->disk_map) {
+        STAT_ADD(fs, bytes_read, (unsigned long)count * FS_BLOCK_SIZE);
+        STAT_ADD(fs, bytes_written, (unsigned long)count * FS_BLOCK_SIZE);
+        memmove(fs->disk_map + (size_t)dst * FS_BLOCK_SIZE, fs->disk_map + (size_t)src * FS_BLOCK_SIZE, 
+                (size_t)count * FS_BLOCK_SIZE);
+        return;
+    }
+
+    char *blocks = malloc((size_t)count * FS_BLOCK_SIZE);
+    if (!blocks) return;
+    disk_read(fs, src, blocks, count);
+    disk_write(fs, dst, blocks, count);
+    free(blocks);
+}
+
+// Holes of the image. A range that is not entirely a hole is read from the
+// image, where any holes it has read as zeros anyway. Writers of different
+// files hold only shared locks and may share a word of hole_map, so its
+// words are updated atomically.
+static int range_is_hole(FsContext *fs, int start, int count) {
+    for (int b = start; b < start + count; b++) {
+        uint64_t word = __atomic_load_n(&fs->hole_map[b / 64], __ATOMIC_RELAXED);
+        if (!(word >> (b % 64) & 1)) return 0;
+    }
+    return 1;
+}
+
+static void set_holes(FsContext *fs, int start, int count, int hole) {
+    int end = start + count;
+    while (start < end) {
+        int word_idx = start / 64;
+        int bits = (end < (word_idx + 1) * 64 ? end : (word_idx + 1) * 64) - start;
+        uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << (start % 64);
+        if (hole) {
+            __atomic_fetch_or(&fs->hole_map[word_idx], mask, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&fs->hole_map[word_idx], ~mask, __ATOMIC_RELAXED);
+        }
+        start += bits;
+    }
+}
+
+// Zero-fill a range by deallocating it. Queued transfers go out first, as
+// one of them may still read the range. Returns -1, and stops trying for
+// this mount, if the image does not support it.
+static int punch_hole(FsContext *fs, int start, int count) {
+#ifdef HAVE_PUNCH_HOLE
+    if (fs->punch_failed || fs->disk_fd == -1) return -1;
+    if (fs->io_queued) io_batch_flush(fs);
+    STAT_ADD(fs, syscalls, 1);
+    if (fallocate(fs->disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                  (off_t)start * FS_BLOCK_SIZE, (off_t)count * FS_BLOCK_SIZE) == -1) {
+        fs->punch_failed = 1;
+        return -1;
+    }
+    STAT_ADD(fs, blocks_punched, count);
+    set_holes(fs, start, count, 1);
+    return 0;
+#else
+    (void)fs; (void)start; (void)count;
+    return -1;
+#endif
+}
+
+// Flag the data blocks that lie wholly inside a hole of the image
+static void find_holes(FsContext *fs) {
+    memset(fs->hole_map, 0, sizeof(fs->hole_map));
+    fs->punch_failed = 0;
+#ifdef HAVE_PUNCH_HOLE
+    off_t offset = (off_t)FIRST_DATA_BLOCK * FS_BLOCK_SIZE;
+    while (offset < DISK_BYTES) {
+        STAT_ADD(fs, syscalls, 1);
+        off_t data = lseek(fs->disk_fd, offset, SEEK_DATA);
+        if (data == -1 && errno != ENXIO) return;  // No SEEK_DATA: assume no holes
+        if (data == -1 || data > DISK_BYTES) data = DISK_BYTES;
+
+        int first = (int)((offset + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+        int end = (int)(data / FS_BLOCK_SIZE);
+        if (end > first) set_holes(fs, first, end - first, 1);
+        if (data == DISK_BYTES) return;
+
+        STAT_ADD(fs, syscalls, 1);
+        offset = lseek(fs->disk_fd, data, SEEK_HOLE);
+        if (offset == -1) return;
+    }
+#endif
+}
+
+// Map a full-size, writable disk image. Anything else stays on pread/pwrite.
+static char *map_disk(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < DISK_BYTES ||
+        (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR) {
+        return NULL;
+    }
+
+    char *map = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+#ifdef HAVE_IO_URING
+static int ring_setup(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, 
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, 
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, 
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ring_teardown(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+    return 0;
+}
+
+static void ring_teardown(IoRing *ring) {
+    if (ring->fd == -1) return;
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Run either the reads (reads set) or the writes and zero-fills of a batch
+// as one submission, and wait for all of them. A failed read leaves zeros,
+// as disk_read does. Returns -1 if the ring itself failed. enters counts
+// the io_uring_enter calls made.
+static int ring_run(IoRing *ring, int fd, const BlockTransfer *transfers, const int *staged,
+                    int count, int reads, char *staging, unsigned long *enters) {
+    struct io_uring_sqe *sqes = ring->sqes;
+    unsigned tail = *ring->sq_tail;
+    unsigned submitted = 0;
+    for (int i = 0; i < count; i++) {
+        const BlockTransfer *t = &transfers[i];
+        if (reads && t->src == -1) continue;
+
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        sqe->len = t->count * FS_BLOCK_SIZE;
+        sqe->user_data = i;
+        if (reads) {
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = (uintptr_t)(staging + staged[i] * FS_BLOCK_SIZE);
+            sqe->off = (uint64_t)t->src * FS_BLOCK_SIZE;
+        } else {
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->addr = (uintptr_t)(t->src == -1 ? zero_blocks : staging + staged[i] * FS_BLOCK_SIZE);
+            sqe->off = (uint64_t)t->dst * FS_BLOCK_SIZE;
+        }
+        ring->sq_array[index] = index;
+        tail++;
+        submitted++;
+    }
+    if (submitted == 0) return 0;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned completed = 0;
+    unsigned to_submit = submitted;
+    while (completed < submitted) {
+        (*enters)++;
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 
+                               submitted - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        to_submit -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            struct io_uring_cqe *cqe = &((struct io_uring_cqe *)ring->cqes)[head & *ring->cq_mask];
+            const BlockTransfer *t = &transfers[cqe->user_data];
+            if (reads && cqe->res < 0) {
+                memset(staging + staged[cqe->user_data] * FS_BLOCK_SIZE, 0, (size_t)t->count * FS_BLOCK_SIZE);
             }
+            completed++;
         }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#else
+static int ring_setup(IoRing *ring, unsigned entries) {
+    (void)entries;
+    ring->fd = -1;
+    return -1;
+}
+
+static void ring_teardown(IoRing *ring) {
+    ring->fd = -1;
+}
+
+static int ring_run(IoRing *ring, int fd, const BlockTransfer *transfers, const int *staged,
+                    int count, int reads, char *staging, unsigned long *enters) {
+    (void)ring; (void)fd; (void)transfers; (void)staged; (void)count; (void)reads; (void)staging;
+    (void)enters;
+    return -1;
+}
+#endif
+
+// Batches are only worth opening with a ring and without a mapping
+static void io_batch_begin(FsContext *fs) {
+    fs->io_batching = fs->ring.fd != -1 && !fs->disk_map;
+}
+
+static void io_batch_end(FsContext *fs) {
+    io_batch_flush(fs);
+    fs->io_batching = 0;
+}
+
+static int ranges_overlap(int a, int a_count, int b, int b_count) {
+    return a < b + b_count && b < a + a_count;
+}
+
+static void io_queue_transfer(FsContext *fs, int dst, int src, int count) {
+    int flush = fs->io_queued == IO_QUEUE_SIZE || 
+                (src != -1 && fs->io_staged + count > MAX_RANGE_BLOCKS);
+    for (int i = 0; i < fs->io_queued && !flush; i++) {
+        const BlockTransfer *t = &fs->io_queue[i];
+        flush = ranges_overlap(dst, count, t->dst, t->count) ||
+                (src != -1 && ranges_overlap(src, count, t->dst, t->count));
     }
+    if (flush) io_batch_flush(fs);
+
+    BlockTransfer *t = &fs->io_queue[fs->io_queued++];
+    t->dst = dst;
+    t->src = src;
+    t->count = count;
+    if (src != -1) fs->io_staged += count;
+}
 
-    // Check 6: Block allocation consistency
-    int block_usage[128] = {0};
-    block_usage[0] = 1;  // Superblock
+// All reads land in io_staging before the first write is issued. If the
+// ring fails, the phase is redone with pread/pwrite; both phases can be
+// repeated safely because no read follows a write.
+static void io_batch_flush(FsContext *fs) {
+    int count = fs->io_queued;
+    if (count == 0) return;
+    fs->io_queued = 0;
+    fs->io_staged = 0;
 
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            !(superblock.inode[i].dir_parent & 0x80)) {
-            int size = superblock.inode[i].used_size & 0x7F;
-            int start = superblock.inode[i].start_block;
-                
-            for (int b = start; b < start + size && b < 128; b++) {
-                if (b >= 1) block_usage[b]++;
+    int staged[IO_QUEUE_SIZE];
+    int blocks = 0;
+    for (int i = 0; i < count; i++) {
+        staged[i] = blocks;
+        if (fs->io_queue[i].src != -1) blocks += fs->io_queue[i].count;
+    }
+
+    for (int reads = 1; reads >= 0; reads--) {
+        unsigned long enters = 0;
+        int ran = fs->ring.fd != -1 && 
+                  ring_run(&fs->ring, fs->disk_fd, fs->io_queue, staged, count, reads, 
+                           fs->io_staging, &enters) == 0;
+        STAT_ADD(fs, syscalls, enters);
+        if (ran) {
+            unsigned long bytes = 0;
+            for (int i = 0; i < count; i++) {
+                if (!reads || fs->io_queue[i].src != -1) {
+                    bytes += (unsigned long)fs->io_queue[i].count * FS_BLOCK_SIZE;
+                }
+            }
+            if (reads) STAT_ADD(fs, bytes_read, bytes);
+            else STAT_ADD(fs, bytes_written, bytes);
+            continue;
+        }
+        ring_teardown(&fs->ring);
+        for (int i = 0; i < count; i++) {
+            const BlockTransfer *t = &fs->io_queue[i];
+            if (reads && t->src != -1) {
+                disk_read(fs, t->src, fs->io_staging + staged[i] * FS_BLOCK_SIZE, t->count);
+            } else if (!reads) {
+                disk_write(fs, t->dst, t->src == -1 ? zero_blocks : fs->io_staging + staged[i] * FS_BLOCK_SIZE, 
+                           t->count);
             }
         }
     }
+}
+
+static void lru_unlink(FsContext *fs, int slot) {
+    CacheEntry *entry = &fs->cache[slot];
+    if (entry->prev != -1) fs->cache[entry->prev].next = entry->next;
+    else fs->cache_head = entry->next;
+    if (entry->next != -1) fs->cache[entry->next].prev = entry->prev;
+    else fs->cache_tail = entry->prev;
+}
+
+static void lru_push_front(FsContext *fs, int slot) {
+    fs->cache[slot].prev = -1;
+    fs->cache[slot].next = fs->cache_head;
+    if (fs->cache_head != -1) fs->cache[fs->cache_head].prev = slot;
+    else fs->cache_tail = slot;
+    fs->cache_head = slot;
+}
+
+static void lru_push_back(FsContext *fs, int slot) {
+    fs->cache[slot].next = -1;
+    fs->cache[slot].prev = fs->cache_tail;
+    if (fs->cache_tail != -1) fs->cache[fs->cache_tail].next = slot;
+    else fs->cache_head = slot;
+    fs->cache_tail = slot;
+}
+
+static int cache_init(FsContext *fs, int capacity) {
+    memset(fs->cache_slot, -1, sizeof(fs->cache_slot));
+    if (capacity == 0) return 0;
+
+    fs->cache = malloc((size_t)capacity * sizeof(CacheEntry));
+    if (!fs->cache) return -1;
+    fs->cache_capacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        fs->cache[i].block = -1;
+        fs->cache[i].dirty = 0;
+        lru_push_back(fs, i);
+    }
+    return 0;
+}
+
+// Write back the run of dirty cached blocks that starts at block and ends
+// before end, WRITE_COMBINE_BLOCKS per disk write. They stay cached.
+// Returns the first block past the run.
+static int cache_flush_run(FsContext *fs, int block, int end) {
+    for (;;) {
+        int count = 0;
+        while (block + count < end && count < WRITE_COMBINE_BLOCKS) {
+            int slot = fs->cache_slot[block + count];
+            if (slot == -1 || !fs->cache[slot].dirty) break;
+            count++;
+        }
+        if (count == 0) return block;
+
+        if (count == 1) {
+            disk_write(fs, block, fs->cache[fs->cache_slot[block]].data, 1);
+        } else {
+            for (int i = 0; i < count; i++) {
+                memcpy(fs->combine_data + i * FS_BLOCK_SIZE, 
+                       fs->cache[fs->cache_slot[block + i]].data, FS_BLOCK_SIZE);
+            }
+            disk_write(fs, block, fs->combine_data, count);
+        }
+        for (int i = 0; i < count; i++) {
+            fs->cache[fs->cache_slot[block + i]].dirty = 0;
+        }
+        block += count;
+    }
+}
+
+// Take the least recently used slot for block, writing back what it held
+// along with the dirty blocks around it
+static int cache_claim(FsContext *fs, int block) {
+    int slot = fs->cache_tail;
+    CacheEntry *entry = &fs->cache[slot];
+    if (entry->block != -1) {
+        if (entry->dirty) {
+            int first = entry->block;
+            while (first > 0 && entry->block - first < WRITE_COMBINE_BLOCKS - 1 && 
+                   fs->cache_slot[first - 1] != -1 && fs->cache[fs->cache_slot[first - 1]].dirty) {
+                first--;
+            }
+            int end = first + WRITE_COMBINE_BLOCKS;
+            cache_flush_run(fs, first, end < FS_BLOCK_COUNT ? end : FS_BLOCK_COUNT);
+        }
+        fs->cache_slot[entry->block] = -1;
+    }
+
+    entry->block = block;
+    entry->dirty = 0;
+    fs->cache_slot[block] = slot;
+    lru_unlink(fs, slot);
+    lru_push_front(fs, slot);
+    return slot;
+}
+
+static void cache_touch(FsContext *fs, int slot) {
+    if (slot != fs->cache_head) {
+        lru_unlink(fs, slot);
+        lru_push_front(fs, slot);
+    }
+}
+
+// Cached blocks are copied out; every run of uncached blocks is fetched
+// with one disk read and then cached.
+static void cache_read(FsContext *fs, int block, void *buf, int count) {
+    if (!fs->cache_capacity) {
+        disk_read(fs, block, buf, count);
+        return;
+    }
+
+    pthread_mutex_lock(&fs->cache_lock);
+    char *out = buf;
+    for (int i = 0; i < count; ) {
+        int slot = fs->cache_slot[block + i];
+        if (slot != -1) {
+            memcpy(out + i * FS_BLOCK_SIZE, fs->cache[slot].data, FS_BLOCK_SIZE);
+            cache_touch(fs, slot);
+            fs->cache_hits++;
+            i++;
+            continue;
+        }
+
+        int end = i + 1;
+        while (end < count && fs->cache_slot[block + end] == -1) end++;
+        disk_read(fs, block + i, out + i * FS_BLOCK_SIZE, end - i);
+        fs->cache_misses += end - i;
+        for (; i < end; i++) {
+            memcpy(fs->cache[cache_claim(fs, block + i)].data, out + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// Fetch the blocks from block on that are not cached yet, up to count of
+// them, with one disk read. Nothing is fetched while block is still cached,
+// so a sequential reader fetches only once it has used up what it has.
+static void cache_prefetch(FsContext *fs, int block, int count) {
+    pthread_mutex_lock(&fs->cache_lock);
+    int n = 0;
+    while (n < count && fs->cache_slot[block + n] == -1) n++;
+    if (n > 0) {
+        disk_read(fs, block, fs->read_ahead_data, n);
+        fs->cache_read_ahead += n;
+        for (int i = 0; i < n; i++) {
+            memcpy(fs->cache[cache_claim(fs, block + i)].data, 
+                   fs->read_ahead_data + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+static void cache_write(FsContext *fs, int block, const void *buf, int count) {
+    if (!fs->cache_capacity) {
+        disk_write(fs, block, buf, count);
+        return;
+    }
+
+    pthread_mutex_lock(&fs->cache_lock);
+    const char *in = buf;
+    for (int i = 0; i < count; i++) {
+        int slot = fs->cache_slot[block + i];
+        if (slot == -1) {
+            slot = cache_claim(fs, block + i);
+        } else {
+            cache_touch(fs, slot);
+        }
+        memcpy(fs->cache[slot].data, in + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        fs->cache[slot].dirty = 1;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// Forget cached copies of a range without writing them back
+static void cache_discard(FsContext *fs, int start, int count) {
+    if (!fs->cache_capacity) return;
+    for (int b = start; b < start + count; b++) {
+        int slot = fs->cache_slot[b];
+        if (slot == -1) continue;
+        fs->cache_slot[b] = -1;
+        fs->cache[slot].block = -1;
+        fs->cache[slot].dirty = 0;
+        lru_unlink(fs, slot);
+        lru_push_back(fs, slot);
+    }
+}
+
+// Write back dirty blocks of a range, one write per run; they stay cached
+static void cache_writeback(FsContext *fs, int start, int count) {
+    if (!fs->cache_capacity) return;
+    for (int b = start; b < start + count; b++) {
+        int slot = fs->cache_slot[b];
+        if (slot != -1 && fs->cache[slot].dirty) {
+            b = cache_flush_run(fs, b, start + count);
+        }
+    }
+}
+
+static void cache_zero(FsContext *fs, int start, int count) {
+    cache_discard(fs, start, count);
+    disk_zero(fs, start, count);
+}
+
+// Moves run on the disk as one bulk copy: the source is written back
+// first, and cached copies of the overwritten destination are dropped.
+static void cache_move(FsContext *fs, int dst, int src, int count) {
+    cache_writeback(fs, src, count);
+    cache_discard(fs, dst, count);
+    disk_move(fs, dst, src, count);
+}
+
+// Freed blocks are zeroed right away, or only flagged in lazy mode
+static void release_blocks(FsContext *fs, int start, int count) {
+    if (count <= 0) return;
+    snapshot_preserve(fs, start, count);
+    if (lazy_zero) {
+        cache_discard(fs, start, count);
+        memset(fs->stale_block + start, 1, count);
+    } else {
+        cache_zero(fs, start, count);
+    }
+}
+
+// Move blocks together with their stale flags; the ranges may overlap
+static void move_blocks(FsContext *fs, int dst, int src, int count) {
+    if (count <= 0 || dst == src) return;
+    STAT_ADD(fs, blocks_moved, count);
+    snapshot_preserve(fs, dst, count);
+    cache_move(fs, dst, src, count);
+    memmove(fs->stale_block + dst, fs->stale_block + src, count);
+}
+
+// Zero flagged blocks in coalesced runs: those in use by files, and with
+// include_free also the free ones.
+static void zero_stale_blocks(FsContext *fs, int include_free) {
+    for (int start = FIRST_DATA_BLOCK; start < FS_BLOCK_COUNT; start++) {
+        if (!fs->stale_block[start] || (!include_free && !get_block_bit(fs, start))) {
+            continue;
+        }
+        int end = start + 1;
+        while (end < FS_BLOCK_COUNT && fs->stale_block[end] && 
+               (include_free || get_block_bit(fs, end))) {
+            end++;
+        }
+        cache_zero(fs, start, end - start);
+        memset(fs->stale_block + start, 0, end - start);
+        start = end;
+    }
+}
+
+// Bring the disk up to date with everything held in memory
+static void settle_disk(FsContext *fs) {
+    if (fs->disk_fd == -1) return;
+    zero_stale_blocks(fs, 0);
+    cache_writeback(fs, 0, FS_BLOCK_COUNT);
+    if (fs->journal_fd != -1) {
+        journal_checkpoint(fs);
+    } else {
+        flush_superblock(fs);
+    }
+}
+
+static void unmount_disk(FsContext *fs) {
+    release_disk(fs, trust_clean ? superblock_checksum(fs) : 0);
+}
+
+// Close the mounted disk, marking it clean for checksum, the superblock it
+// was left with. mount_disk has already loaded the next disk's superblock
+// by the time it releases the previous disk, so it passes the old one's.
+static void release_disk(FsContext *fs, uint64_t checksum) {
+    settle_disk(fs);
+    snapshot_discard(fs);
+    cache_discard(fs, 0, FS_BLOCK_COUNT);
+    if (trust_clean && fs->superblock_consistent && fs->disk_fd != -1) {
+        put_clean_marker(fs, checksum);
+    }
+    journal_close(fs);
+    if (fs->disk_map) {
+        munmap(fs->disk_map, DISK_BYTES);
+        fs->disk_map = NULL;
+    }
+    if (fs->disk_fd != -1) {
+        close(fs->disk_fd);
+        fs->disk_fd = -1;
+    }
+    if (fs->current_disk) {
+        free(fs->current_disk);
+        fs->current_disk = NULL;
+    }
+}
+
+// The in-memory superblock is a write-back cache of block 0: metadata
+// changes only mark it dirty, and it reaches the disk on sync, remount or
+// exit (or immediately in write-through mode). With a journal, changes
+// reach the journal instead and block 0 is only written at checkpoints.
+static void write_superblock(FsContext *fs) {
+    fs->superblock_dirty = 1;
+    if (write_through && !fs->hold_flush && fs->journal_fd == -1) flush_superblock(fs);
+}
+
+static void flush_superblock(FsContext *fs) {
+    if (fs->superblock_dirty && fs->disk_fd != -1) {
+        disk_write(fs, 0, &fs->superblock, SUPERBLOCK_BLOCKS);
+    }
+    fs->superblock_dirty = 0;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint64_t ka = *(const uint64_t *)a;
+    uint64_t kb = *(const uint64_t *)b;
+    return (ka > kb) - (ka < kb);
+}
+
+// Only images of other geometries have a header to compare; classic
+// images are recognised by check_consistency alone, as they always were
+static int geometry_matches(const Superblock *superblock) {
+#if FS_CLASSIC
+    (void)superblock;
+    return 1;
+#else
+    const SuperblockHeader *header = &superblock->header;
+    return memcmp(header->magic, geometry_magic, sizeof(geometry_magic)) == 0 &&
+           header->version == FORMAT_GEOMETRY && header->block_size == FS_BLOCK_SIZE &&
+           header->block_count == FS_BLOCK_COUNT && header->inode_count == FS_INODE_COUNT &&
+           header->superblock_blocks == (uint32_t)SUPERBLOCK_BLOCKS;
+#endif
+}
+
+// An empty file system: no inodes, and only the superblock's blocks in use
+static void format_superblock(Superblock *superblock) {
+    memset(superblock, 0, sizeof(Superblock));
+#if !FS_CLASSIC
+    memcpy(superblock->header.magic, geometry_magic, sizeof(geometry_magic));
+    superblock->header.version = FORMAT_GEOMETRY;
+    superblock->header.block_size = FS_BLOCK_SIZE;
+    superblock->header.block_count = FS_BLOCK_COUNT;
+    superblock->header.inode_count = FS_INODE_COUNT;
+    superblock->header.superblock_blocks = SUPERBLOCK_BLOCKS;
+#endif
+    for (int b = 0; b < FIRST_DATA_BLOCK; b++) {
+        superblock->free_block_list[b / 8] |= (char)(1 << (b % 8));
+    }
+}
+
+// The in-use and directory masks are rebuilt with the index on every load,
+// so the checks walk the set bits of a mask rather than the whole table.
+// Each check still runs to completion before the next one, so the first
+// failing check is the one reported.
+static int check_consistency(FsContext *fs) {
+    const Inode *inodes = fs->superblock.inode;
+
+    // Check 1: Verify free inodes
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = ~fs->inode_used[w] & inode_slots(w); bits; bits &= bits - 1) {
+            if (inodes[w * 64 + __builtin_ctzll(bits)].start_block != 0) {
+                return 1;
+            }
+        }
+    }
+
+    // Check 2: Valid start block and size for files
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w] & ~fs->inode_dir[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            int size = inodes[i].used_size & FIELD_MASK;
+            int start = inodes[i].start_block;
+
+            // A mapped file needs a map block and a loaded map covering it
+            if (start & EXTENT_MAPPED) {
+                int mapped = 0;
+                for (int e = 0; e < (int)fs->extent_count[i]; e++) {
+                    mapped += fs->extent[i][e].count;
+                }
+                if ((start & FIELD_MASK) < FIRST_DATA_BLOCK || fs->extent_count[i] == 0 || mapped != size) {
+                    return 2;
+                }
+                continue;
+            }
+            
+            if (start < FIRST_DATA_BLOCK || start > FS_BLOCK_COUNT - 1 || 
+                start + size - 1 < FIRST_DATA_BLOCK || start + size - 1 > FS_BLOCK_COUNT - 1) {
+                return 2;
+            }
+        }
+    }
+
+    // Check 3: Directory attributes
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_dir[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            if (inodes[i].start_block != 0 || (inodes[i].used_size & FIELD_MASK) != 0) {
+                return 3;
+            }
+        }
+    }
+
+    // Check 4: Parent directory validity
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w]; bits; bits &= bits - 1) {
+            int parent = inodes[w * 64 + __builtin_ctzll(bits)].dir_parent & FIELD_MASK;
+            if (parent == FS_INODE_COUNT) return 4;
+            if (parent != ROOT_PARENT) {
+                if (parent < 0 || parent > FS_INODE_COUNT - 1) return 4;
+                if (!inode_is_dir(fs, parent)) return 4;
+            }
+        }
+    }
+
+    // Check 5: Unique names within directories. Entries of every directory
+    // are keyed by (parent, name), so duplicates end up adjacent after
+    // sorting. The index already holds each key.
+    uint64_t keys[FS_INODE_COUNT];
+    int key_count = 0;
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            int parent = inodes[i].dir_parent & FIELD_MASK;
+            if (parent < FS_INODE_COUNT && inode_is_dir(fs, parent)) {
+                keys[key_count++] = fs->inode_key[i];
+            }
+        }
+    }
+    qsort(keys, key_count, sizeof(uint64_t), compare_keys);
+    for (int i = 1; i < key_count; i++) {
+        if (keys[i] == keys[i - 1]) {
+            return 5;
+        }
+    }
+
+    // Check 6: Block allocation consistency. The blocks in use are collected
+    // as a bitmap, which has to match the free-block list word for word.
+    uint64_t block_usage[BITMAP_WORDS] = {0};
+    for (int b = 0; b < FIRST_DATA_BLOCK; b++) {
+        block_usage[b / 64] |= 1ULL << (b % 64);  // Superblock
+    }
+
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w] & ~fs->inode_dir[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            int size = inodes[i].used_size & FIELD_MASK;
+            int start = inodes[i].start_block;
+
+            if (start & EXTENT_MAPPED) {
+                int block = start & FIELD_MASK;
+                block_usage[block / 64] |= 1ULL << (block % 64);
+                for (int e = 0; e < (int)fs->extent_count[i]; e++) {
+                    const Extent *extent = &fs->extent[i][e];
+                    for (int b = extent->start; b < (int)(extent->start + extent->count); b++) {
+                        block_usage[b / 64] |= 1ULL << (b % 64);
+                    }
+                }
+                continue;
+            }
+                
+            for (int b = start; b < start + size && b < FS_BLOCK_COUNT; b++) {
+                if (b >= FIRST_DATA_BLOCK) block_usage[b / 64] |= 1ULL << (b % 64);
+            }
+        }
+    }
+
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        if (bitmap_word(fs, w) != block_usage[w]) {
+            return 6;
+        }
+    }
+    
+    return 0;
+}
+
+// FNV-1a over the raw superblock
+static uint64_t superblock_checksum(FsContext *fs) {
+    return fnv1a(0xcbf29ce484222325ULL, &fs->superblock, sizeof(Superblock));
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Returns 1 if fd carries a clean marker matching the loaded superblock.
+// A marker that is found is removed, so a crash while mounted leaves none.
+static int take_clean_marker(FsContext *fs, int fd) {
+    CleanMarker marker;
+    STAT_ADD(fs, syscalls, 1);
+    STAT_ADD(fs, bytes_read, sizeof(marker));
+    if (pread(fd, &marker, sizeof(marker), DISK_BYTES) != sizeof(marker) ||
+        memcmp(marker.magic, clean_magic, sizeof(clean_magic)) != 0) {
+        return 0;
+    }
+    STAT_ADD(fs, syscalls, 1);
+    (void)!ftruncate(fd, DISK_BYTES);
+    return marker.checksum == superblock_checksum(fs);
+}
+
+// Called once the superblock is flushed, and only for a superblock that is
+// known to be consistent, so the next mount may trust it without checking.
+static void put_clean_marker(FsContext *fs, uint64_t checksum) {
+    CleanMarker marker;
+    memcpy(marker.magic, clean_magic, sizeof(clean_magic));
+    marker.checksum = checksum;
+    STAT_ADD(fs, syscalls, 1);
+    STAT_ADD(fs, bytes_written, sizeof(marker));
+    (void)!pwrite(fs->disk_fd, &marker, sizeof(marker), DISK_BYTES);
+}
+
+// Apply the valid prefix of the journal at path to superblock. Returns
+// the number of records applied; valid_end is set to where they end, so a
+// torn or corrupt tail can be cut off.
+static int journal_replay(Superblock *superblock, const char *path, off_t *valid_end) {
+    *valid_end = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+
+    int records = 0;
+    off_t offset = 0;
+    char record[JOURNAL_BUFFER_SIZE];
+    JournalHeader header;
+    while (pread(fd, &header, sizeof(header), offset) == sizeof(header)) {
+        if (memcmp(header.magic, journal_magic, sizeof(journal_magic)) != 0 ||
+            header.seq != (uint32_t)records || header.count > SUPERBLOCK_WORDS) {
+            break;
+        }
+        size_t length = sizeof(header) + header.count * JOURNAL_ENTRY_SIZE;
+        if (length > sizeof(record)) break;
+        if (pread(fd, record, length, offset) != (ssize_t)length) break;
+
+        uint64_t checksum = header.checksum;
+        memset(record + offsetof(JournalHeader, checksum), 0, sizeof(uint64_t));
+        if (fnv1a(0xcbf29ce484222325ULL, record, length) != checksum) break;
+
+        const uint8_t *entry = (const uint8_t *)record + sizeof(header);
+        for (uint32_t k = 0; k < header.count; k++, entry += JOURNAL_ENTRY_SIZE) {
+            uint32_t w = 0;
+            for (int i = 0; i < JOURNAL_INDEX_SIZE; i++) w |= (uint32_t)entry[i] << (8 * i);
+            if (w < (uint32_t)SUPERBLOCK_WORDS) {
+                memcpy((char *)superblock + (size_t)w * 8, entry + JOURNAL_INDEX_SIZE, 8);
+            }
+        }
+        offset += length;
+        records++;
+    }
+    close(fd);
+    *valid_end = offset;
+    return records;
+}
+
+// Start journaling for the disk just mounted. A journal that was replayed
+// is kept, minus any torn tail; the superblock it produced is not in
+// block 0 yet, so it will be flushed by the next checkpoint.
+static void journal_open(FsContext *fs, const char *disk_name, int records, off_t valid_end) {
+    size_t len = strlen(disk_name);
+    fs->journal_path = malloc(len + sizeof(".journal"));
+    if (!fs->journal_path) return;
+    memcpy(fs->journal_path, disk_name, len);
+    memcpy(fs->journal_path + len, ".journal", sizeof(".journal"));
+
+    fs->journal_fd = open(fs->journal_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fs->journal_fd == -1) {
+        free(fs->journal_path);
+        fs->journal_path = NULL;
+        return;
+    }
+    STAT_ADD(fs, syscalls, 1);
+    (void)!ftruncate(fs->journal_fd, valid_end);
+    fs->journal_base = fs->superblock;
+    fs->journal_buffered = 0;
+    fs->journal_pending = 0;
+    fs->journal_seq = records;
+    fs->journal_size = valid_end;
+    fs->journal_unsynced = 0;
+    fs->journal_barrier = 0;
+    if (records > 0) fs->superblock_dirty = 1;
+}
+
+// Called after the final checkpoint, so the journal is empty and can go
+static void journal_close(FsContext *fs) {
+    if (fs->journal_fd == -1) return;
+    close(fs->journal_fd);
+    fs->journal_fd = -1;
+    unlink(fs->journal_path);
+    free(fs->journal_path);
+    fs->journal_path = NULL;
+}
+
+// Buffer a record of the superblock words that changed since the last one.
+// A change too large for the buffer, which only a large superblock can
+// have, is checkpointed instead.
+static void journal_record(FsContext *fs) {
+    if (fs->journal_fd == -1) return;
+    const uint64_t *now = (const uint64_t *)&fs->superblock;
+    uint64_t *base = (uint64_t *)&fs->journal_base;
+    if (memcmp(now, base, sizeof(Superblock)) == 0) return;
+
+    size_t changed = 0;
+    for (int w = 0; w < SUPERBLOCK_WORDS; w++) {
+        changed += now[w] != base[w];
+    }
+    if (sizeof(JournalHeader) + changed * JOURNAL_ENTRY_SIZE > JOURNAL_BUFFER_SIZE) {
+        journal_checkpoint(fs);
+        fs->journal_base = fs->superblock;
+        return;
+    }
+    if (fs->journal_buffered + sizeof(JournalHeader) + changed * JOURNAL_ENTRY_SIZE > 
+        JOURNAL_BUFFER_SIZE) {
+        journal_commit(fs, 0);
+    }
+
+    char *record = fs->journal_buffer + fs->journal_buffered;
+    uint8_t *entry = (uint8_t *)record + sizeof(JournalHeader);
+    JournalHeader header;
+    memcpy(header.magic, journal_magic, sizeof(journal_magic));
+    header.checksum = 0;
+    header.seq = fs->journal_seq;
+    header.count = 0;
+    for (int w = 0; w < SUPERBLOCK_WORDS; w++) {
+        if (now[w] == base[w]) continue;
+        for (int i = 0; i < JOURNAL_INDEX_SIZE; i++) entry[i] = (uint8_t)(w >> (8 * i));
+        memcpy(entry + JOURNAL_INDEX_SIZE, &now[w], 8);
+        entry += JOURNAL_ENTRY_SIZE;
+        base[w] = now[w];
+        header.count++;
+    }
+
+    size_t length = sizeof(header) + header.count * JOURNAL_ENTRY_SIZE;
+    memcpy(record, &header, sizeof(header));
+    header.checksum = fnv1a(0xcbf29ce484222325ULL, record, length);
+    memcpy(record, &header, sizeof(header));
+    fs->journal_buffered += length;
+    fs->journal_pending++;
+    fs->journal_seq++;
+}
+
+// Write the buffered records with one append. A durable commit first makes
+// moved data blocks durable, then syncs the journal, so a synced record
+// never describes data that could still be lost.
+static void journal_commit(FsContext *fs, int durable) {
+    if (fs->journal_fd == -1) return;
+    if (fs->journal_buffered > 0) {
+        if (fs->io_queued) io_batch_flush(fs);
+        if (durable && fs->journal_barrier) {
+            sync_disk_data(fs);
+            fs->journal_barrier = 0;
+        }
+
+        size_t done = 0;
+        while (done < fs->journal_buffered) {
+            ssize_t n = write(fs->journal_fd, fs->journal_buffer + done, 
+                              fs->journal_buffered - done);
+            STAT_ADD(fs, syscalls, 1);
+            if (n <= 0) break;
+            done += n;
+        }
+        STAT_ADD(fs, bytes_written, done);
+        fs->journal_size += done;
+        fs->journal_buffered = 0;
+        fs->journal_pending = 0;
+        fs->journal_unsynced = 1;
+    }
+
+    if (durable && fs->journal_unsynced) {
+        if (fs->journal_barrier) {
+            sync_disk_data(fs);
+            fs->journal_barrier = 0;
+        }
+        STAT_ADD(fs, syscalls, 1);
+        fdatasync(fs->journal_fd);
+        fs->journal_unsynced = 0;
+    }
+    if (fs->journal_size >= JOURNAL_CHECKPOINT) journal_checkpoint(fs);
+}
+
+// Fold the journal into block 0 and empty it. Buffered records are simply
+// dropped, as the superblock written here already contains them.
+static void journal_checkpoint(FsContext *fs) {
+    fs->journal_buffered = 0;
+    fs->journal_pending = 0;
+    flush_superblock(fs);
+    sync_disk_data(fs);
+    STAT_ADD(fs, syscalls, 1);
+    (void)!ftruncate(fs->journal_fd, 0);
+    fs->journal_seq = 0;
+    fs->journal_size = 0;
+    fs->journal_unsynced = 0;
+    fs->journal_barrier = 0;
+}
+
+// Get the metadata of blocks just moved into the journal before their old
+// location is released, so a crash never leaves the only copy unreferenced
+static void journal_write_ahead(FsContext *fs) {
+    if (fs->journal_fd == -1) return;
+    fs->journal_barrier = 1;
+    journal_record(fs);
+    journal_commit(fs, 0);
+}
+
+// End of a metadata command: record it, and commit once a group is full
+static void end_update(FsContext *fs) {
+    if (fs->journal_fd == -1) return;
+    journal_record(fs);
+    if (write_through || fs->journal_pending >= JOURNAL_GROUP) journal_commit(fs, 1);
+}
+
+static void sync_disk_data(FsContext *fs) {
+    if (fs->io_queued) io_batch_flush(fs);
+    if (fs->disk_map) {
+        STAT_ADD(fs, syscalls, 1);
+        msync(fs->disk_map, DISK_BYTES, MS_SYNC);
+    } else if (fs->disk_fd != -1) {
+        STAT_ADD(fs, syscalls, 1);
+        fdatasync(fs->disk_fd);
+    }
+}
+
+// Copy the blocks of a range that the snapshot still needs before they
+// change, and note the others as changed. Blocks of one range belong to
+// one file, so callers holding only that file's inode lock never race here.
+static void snapshot_preserve(FsContext *fs, int start, int count) {
+    if (!fs->snapshot_active) return;
+    for (int b = start; b < start + count; b++) {
+        if (fs->snapshot_state[b] == SNAPSHOT_NEEDED) {
+            cache_read(fs, b, fs->snapshot_data[b], 1);
+            fs->snapshot_state[b] = SNAPSHOT_KEPT;
+        } else if (fs->snapshot_state[b] == SNAPSHOT_CLEAN) {
+            fs->snapshot_state[b] = SNAPSHOT_CHANGED;
+        }
+    }
+}
+
+static void snapshot_discard(FsContext *fs) {
+    if (fs->snapshot_data) munmap(fs->snapshot_data, DISK_BYTES);
+    fs->snapshot_data = NULL;
+    fs->snapshot_active = 0;
+}
+
+// Replaces any snapshot already taken
+static void take_snapshot(FsContext *fs) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    // Room for every block is reserved up front but only touched as blocks
+    // are preserved, so an unused snapshot costs no copying
+    if (!fs->snapshot_data) {
+        void *data = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, 
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        fs->snapshot_data = data == MAP_FAILED ? NULL : data;
+    }
+    if (!fs->snapshot_data) {
+        fprintf(fs->err, "Error: Not enough memory for a snapshot of %s\n", fs->current_disk);
+        fs->snapshot_active = 0;
+        return;
+    }
+
+    fs->snapshot_superblock = fs->superblock;
+    fs->snapshot_consistent = fs->superblock_consistent;
+    memcpy(fs->snapshot_stale, fs->stale_block, sizeof(fs->snapshot_stale));
+    memset(fs->snapshot_state, SNAPSHOT_CLEAN, FIRST_DATA_BLOCK);
+    for (int b = FIRST_DATA_BLOCK; b < FS_BLOCK_COUNT; b++) {
+        // Stale blocks read as zeros, so only live data needs preserving
+        fs->snapshot_state[b] = get_block_bit(fs, b) && !fs->stale_block[b] 
+                                ? SNAPSHOT_NEEDED : SNAPSHOT_CLEAN;
+    }
+    fs->snapshot_active = 1;
+}
+
+static void rollback_snapshot(FsContext *fs) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+    if (!fs->snapshot_active) {
+        fprintf(fs->err, "Error: No snapshot of %s to roll back to\n", fs->current_disk);
+        return;
+    }
+
+    // Stop preserving, then undo every block change made since
+    fs->snapshot_active = 0;
+    for (int b = FIRST_DATA_BLOCK; b < FS_BLOCK_COUNT; b++) {
+        if (fs->snapshot_state[b] == SNAPSHOT_KEPT) {
+            cache_write(fs, b, fs->snapshot_data[b], 1);
+            fs->stale_block[b] = 0;
+        } else if (fs->snapshot_state[b] == SNAPSHOT_CHANGED && !fs->snapshot_stale[b]) {
+            release_blocks(fs, b, 1);
+        } else if (fs->snapshot_stale[b]) {
+            // Reads as zeros again, whether or not it was zeroed since
+            cache_discard(fs, b, 1);
+            fs->stale_block[b] = 1;
+        }
+    }
+
+    fs->superblock = fs->snapshot_superblock;
+    index_rebuild(fs);
+    load_extent_maps(fs, -1, NULL);
+    fs->largest_free_run = -1;
+    fs->next_fit_cursor = FIRST_DATA_BLOCK;
+    memset(fs->read_next, -1, sizeof(fs->read_next));
+    fs->superblock_consistent = fs->snapshot_consistent;
+
+    // The current directory may not exist in the snapshot
+    int cwd = fs->current_dir_inode;
+    if (cwd != 0 && (!(fs->superblock.inode[cwd].used_size & INODE_FLAG) || 
+                     !(fs->superblock.inode[cwd].dir_parent & INODE_FLAG))) {
+        fs->current_dir_inode = 0;
+    }
+
+    write_superblock(fs);
+    snapshot_discard(fs);
+}
+
+FsContext *fs_new(FILE *out, FILE *err) {
+    FsContext *fs = calloc(1, sizeof(FsContext));
+    if (!fs) return NULL;
+    fs->out = out;
+    fs->err = err;
+    fs->disk_fd = -1;
+    fs->cache_head = -1;
+    fs->cache_tail = -1;
+    fs->largest_free_run = -1;
+    fs->alloc_policy = default_alloc_policy;
+    fs->next_fit_cursor = FIRST_DATA_BLOCK;
+    memset(fs->read_next, -1, sizeof(fs->read_next));
+    if (cache_init(fs, cache_blocks) == -1) {
+        free(fs);
+        return NULL;
+    }
+
+    // Without io_uring support, batches are never opened
+    fs->ring.fd = -1;
+    fs->journal_fd = -1;
+    if (use_io_uring) ring_setup(&fs->ring, 256);
+
+    pthread_rwlock_init(&fs->meta_lock, NULL);
+    for (int i = 0; i < FS_INODE_COUNT; i++) {
+        pthread_rwlock_init(&fs->inode_lock[i], NULL);
+    }
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    pthread_mutex_init(&fs->path_lock, NULL);
+    fs->path_generation = 1;
+    return fs;
+}
+
+// Unmount whatever is mounted and release the context. No other thread
+// may still be using it.
+void fs_free(FsContext *fs) {
+    unmount_disk(fs);
+    ring_teardown(&fs->ring);
+    pthread_mutex_destroy(&fs->path_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    for (int i = 0; i < FS_INODE_COUNT; i++) {
+        pthread_rwlock_destroy(&fs->inode_lock[i]);
+    }
+    pthread_rwlock_destroy(&fs->meta_lock);
+    free(fs->cache);
+    free(fs);
+}
+
+static void mount_disk(FsContext *fs, char *new_disk_name) {
+    // Fall back to read-only so a write-protected disk can still be inspected
+    int fd = open(new_disk_name, O_RDWR);
+    if (fd == -1) fd = open(new_disk_name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(fs->err, "Error: Cannot find disk %s\n", new_disk_name);
+        return;
+    }
+
+    // Pending changes to the current disk must land before it is replaced
+    settle_disk(fs);
+    snapshot_discard(fs);
+    uint64_t previous_checksum = trust_clean ? superblock_checksum(fs) : 0;
+
+    // Read superblock
+    char *map = use_mmap ? map_disk(fd) : NULL;
+    STAT_ADD(fs, bytes_read, sizeof(Superblock));
+    if (map) {
+        memcpy(&fs->superblock, map, sizeof(Superblock));
+    } else {
+        STAT_ADD(fs, syscalls, 1);
+        if (pread(fd, &fs->superblock, sizeof(Superblock), 0) < 0) {
+            memset(&fs->superblock, 0, sizeof(Superblock));
+        }
+    }
+
+    // Changes since the last checkpoint live in the journal, which is
+    // replayed even without -J so a later -J mount never sees it as new
+    int journal_records = 0;
+    off_t journal_end = 0;
+    char journal_path[PATH_MAX];
+    int have_journal_path = snprintf(journal_path, sizeof(journal_path), "%s.journal",
+                                     new_disk_name) < (int)sizeof(journal_path);
+    if (have_journal_path) {
+        journal_records = journal_replay(&fs->superblock, journal_path, &journal_end);
+    }
+    index_rebuild(fs);
+    load_extent_maps(fs, fd, map);
+    fs->largest_free_run = -1;
+    fs->next_fit_cursor = FIRST_DATA_BLOCK;
+    fs->compact_credit = 0;
+    memset(fs->read_next, -1, sizeof(fs->read_next));
+
+    // Check consistency, unless the disk was cleanly unmounted and trusted
+    int consistency = 0;
+    if (!geometry_matches(&fs->superblock)) {
+        fprintf(fs->err, "Error: Disk %s was not formatted for this geometry\n", new_disk_name);
+        consistency = -1;
+    } else if (!(trust_clean && take_clean_marker(fs, fd))) {
+        consistency = check_consistency(fs);
+        if (consistency != 0) {
+            fprintf(fs->err, "Error: File system in %s is inconsistent (error code: %d)\n", 
+                    new_disk_name, consistency);
+        }
+    }
+    if (consistency != 0) {
+        // The loaded superblock no longer describes the disk still mounted
+        fs->superblock_consistent = 0;
+        if (map) munmap(map, DISK_BYTES);
+        close(fd);
+        return;
+    }
+
+    // Release the previous disk and keep the new one open for the whole mount
+    release_disk(fs, previous_checksum);
+    fs->current_disk = strdup(new_disk_name);
+    fs->disk_fd = fd;
+    fs->disk_map = map;
+    fs->superblock_consistent = 1;
+    fs->current_dir_inode = 0;
+    if (use_journal) {
+        journal_open(fs, new_disk_name, journal_records, journal_end);
+    } else if (have_journal_path && (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR) {
+        // Without -J the journal is folded into block 0 and removed; on a
+        // read-only disk it stays for a mount that can write it back
+        if (journal_records > 0) {
+            fs->superblock_dirty = 1;
+            flush_superblock(fs);
+            sync_disk_data(fs);
+        }
+        unlink(journal_path);
+    }
+    if (use_holes) find_holes(fs);
+
+    // Free blocks of a lazily zeroed disk may hold old data
+    for (int i = 0; i < FS_BLOCK_COUNT; i++) {
+        fs->stale_block[i] = lazy_zero && i >= FIRST_DATA_BLOCK && !get_block_bit(fs, i);
+    }
+
+    // Zero out buffer
+    memset(fs->buffer, 0, sizeof(fs->buffer));
+}
+
+void fs_mount(FsContext *fs, char *new_disk_name) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    mount_disk(fs, new_disk_name);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+static void create_entry(FsContext *fs, const char *path, int size) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    char name[6];
+    int dir = split_path(fs, path, name);
+    if (dir == -1) return;
+
+    // Find free inode
+    int inode_idx = find_free_inode(fs);
+    if (inode_idx == -1) {
+        fprintf(fs->err, "Error: Superblock in disk %s is full, cannot create %s\n", 
+                fs->current_disk, name);
+        return;
+    }
+
+    // Modify the free block finding logic
+    int start_block = 0;
+    if (size > 0) {  // File
+        start_block = find_contiguous_blocks(fs, size);
+        if (start_block == -1 && fs->compact_budget > 0 && count_free_blocks(fs) >= size) {
+            // Compact just enough to make room rather than fail or scatter
+            int done;
+            if (compact_blocks(fs, FS_BLOCK_COUNT, size, &done) > 0) {
+                start_block = find_contiguous_blocks(fs, size);
+            }
+        }
+        if (start_block == -1 && use_extents && count_free_blocks(fs) > size) {
+            // Scattered free blocks still hold it, with one more for the map
+            fs->extent_count[inode_idx] = 0;
+            if (allocate_extents(fs, inode_idx, size) == -1) {
+                // Only the extents just added are undone, and as nothing was
+                // written to them yet they just go back to the bitmap
+                for (int e = 0; e < (int)fs->extent_count[inode_idx]; e++) {
+                    const Extent *extent = &fs->extent[inode_idx][e];
+                    mark_blocks(fs, extent->start, extent->count, 0);
+                }
+                fs->extent_count[inode_idx] = 0;
+                fprintf(fs->err, "Error: Cannot allocate %d blocks on %s\n", size, fs->current_disk);
+                return;
+            }
+            start_block = EXTENT_MAPPED | take_free_block(fs);
+        } else if (start_block == -1) {
+            fprintf(fs->err, "Error: Cannot allocate %d blocks on %s\n", size, fs->current_disk);
+            return;
+        } else {
+            // Mark blocks as used
+            mark_blocks(fs, start_block, size, 1);
+        }
+    }
+
+    // Initialize inode with proper values
+    memcpy(fs->superblock.inode[inode_idx].name, name, 5);
+    fs->superblock.inode[inode_idx].used_size = INODE_FLAG | (size & FIELD_MASK);
+    fs->superblock.inode[inode_idx].start_block = start_block;
+    fs->superblock.inode[inode_idx].dir_parent = (size == 0 ? INODE_FLAG : 0) | 
+                                           (dir == 0 ? ROOT_PARENT : dir);
+    if (start_block & EXTENT_MAPPED) store_extent_map(fs, inode_idx);
+    index_insert(fs, inode_idx);
+    fs->read_next[inode_idx] = -1;
+
+    // An orphan or a duplicate name would fail the next check_consistency
+    int parent = fs->superblock.inode[inode_idx].dir_parent & FIELD_MASK;
+    if (parent != ROOT_PARENT && 
+        (!(fs->superblock.inode[parent].used_size & INODE_FLAG) ||
+         !(fs->superblock.inode[parent].dir_parent & INODE_FLAG) ||
+         find_inode(fs, dir, name, -1) != inode_idx)) {
+        fs->superblock_consistent = 0;
+    }
+
+    write_superblock(fs);
+}
+
+void fs_create(FsContext *fs, const char *path, int size) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    create_entry(fs, path, size);
+    end_update(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+static void delete_entry(FsContext *fs, const char *path, int inode_idx) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    // Find the file/directory
+    int target_inode = inode_idx;
+    if (target_inode == -1) {
+        char name[6];
+        int dir = split_path(fs, path, name);
+        if (dir == -1) return;
+        target_inode = find_inode(fs, dir, name, -1);
+        if (target_inode == -1) {
+            fprintf(fs->err, "Error: File or directory %s does not exist\n", name);
+            return;
+        }
+    }
+
+    if (fs->superblock.inode[target_inode].dir_parent & INODE_FLAG) {
+        delete_tree(fs, target_inode);
+        return;
+    }
+
+    // Mark blocks as free and zero them out
+    release_file(fs, target_inode);
+
+    // Zero out the inode
+    index_remove(fs, target_inode);
+    memset(&fs->superblock.inode[target_inode], 0, sizeof(Inode));
+    fs->read_next[target_inode] = -1;
+    
+    // Write changes back to disk
+    write_superblock(fs);
+}
+
+static void add_block_range(uint64_t *map, int start, int count) {
+    int end = start + count > FS_BLOCK_COUNT ? FS_BLOCK_COUNT : start + count;
+    while (start < end) {
+        int word_idx = start / 64;
+        int bits = (end < (word_idx + 1) * 64 ? end : (word_idx + 1) * 64) - start;
+        map[word_idx] |= (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << (start % 64);
+        start += bits;
+    }
+}
+
+// Delete a directory and everything below it in one pass. The subtree is
+// listed breadth first in tree_list, each inode once, so a directory that
+// names itself or an ancestor as parent is not visited again. The blocks
+// of all its files come off the free-block list together and are released
+// in coalesced runs, and the superblock is written once at the end.
+static void delete_tree(FsContext *fs, int dir) {
+    InodeRef *list = fs->tree_list;
+    memset(fs->tree_listed, 0, sizeof(fs->tree_listed));
+    memset(fs->tree_blocks, 0, sizeof(fs->tree_blocks));
+    int count = 0;
+    list[count++] = dir;
+    fs->tree_listed[dir / 64] |= 1ULL << (dir % 64);
+    for (int k = 0; k < count; k++) {
+        int parent = list[k];
+        if (!inode_is_dir(fs, parent)) continue;
+        for (int child = fs->first_child[parent]; child != -1; child = fs->next_sibling[child]) {
+            uint64_t bit = 1ULL << (child % 64);
+            if (fs->tree_listed[child / 64] & bit) continue;
+            fs->tree_listed[child / 64] |= bit;
+            list[count++] = child;
+        }
+    }
+
+    // Collect the blocks of every file, extents and map blocks included
+    for (int k = 0; k < count; k++) {
+        int i = list[k];
+        if (inode_is_dir(fs, i)) continue;
+        int start = fs->superblock.inode[i].start_block;
+        if (!(start & EXTENT_MAPPED)) {
+            add_block_range(fs->tree_blocks, start, fs->superblock.inode[i].used_size & FIELD_MASK);
+            continue;
+        }
+        for (int e = 0; e < (int)fs->extent_count[i]; e++) {
+            add_block_range(fs->tree_blocks, fs->extent[i][e].start, fs->extent[i][e].count);
+        }
+        fs->extent_count[i] = 0;
+        if ((start & FIELD_MASK) != 0) add_block_range(fs->tree_blocks, start & FIELD_MASK, 1);
+    }
+
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        if (fs->tree_blocks[w]) store_bitmap_word(fs, w, bitmap_word(fs, w) & ~fs->tree_blocks[w]);
+    }
+    fs->largest_free_run = -1;
+
+    io_batch_begin(fs);
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        uint64_t word = fs->tree_blocks[w];
+        while (word) {
+            int start = w * 64 + __builtin_ctzll(word);
+            int end = start;
+            while (end < FS_BLOCK_COUNT && (fs->tree_blocks[end / 64] >> (end % 64) & 1)) {
+                fs->tree_blocks[end / 64] &= ~(1ULL << (end % 64));
+                end++;
+            }
+            release_blocks(fs, start, end - start);
+            word = fs->tree_blocks[w];
+        }
+    }
+    io_batch_end(fs);
+
+    for (int k = 0; k < count; k++) {
+        index_remove(fs, list[k]);
+        memset(&fs->superblock.inode[list[k]], 0, sizeof(Inode));
+        fs->read_next[list[k]] = -1;
+    }
+    write_superblock(fs);
+}
+
+void fs_delete(FsContext *fs, const char *path, int inode_idx) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    delete_entry(fs, path, inode_idx);
+    end_update(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Find a file by path and check that it has blocks
+// block_num to block_num + count - 1. Returns its inode index or -1.
+static int find_file_range(FsContext *fs, const char *path, int block_num, int count) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return -1;
+    }
+
+    char name[6];
+    int dir = split_path(fs, path, name);
+    if (dir == -1) return -1;
+    int found = find_inode(fs, dir, name, 0);
+
+    if (found == -1) {
+        fprintf(fs->err, "Error: File %s does not exist\n", name);
+        return -1;
+    }
+
+    int size = fs->superblock.inode[found].used_size & FIELD_MASK;
+    if (block_num < 0 || block_num >= size) {
+        fprintf(fs->err, "Error: %s does not have block %d\n", name, block_num);
+        return -1;
+    }
+    if (block_num + count > size) {
+        fprintf(fs->err, "Error: %s does not have block %d\n", name, size);
+        return -1;
+    }
+    return found;
+}
+
+void fs_read(FsContext *fs, const char *path, int block_num) {
+    fs_read_range(fs, path, block_num, 1);
+}
+
+// Read count consecutive blocks of a file into the buffer in one transfer
+void fs_read_range(FsContext *fs, const char *path, int block_num, int count) {
+    fs_read_blocks(fs, path, block_num, count, fs->buffer);
+}
+
+// Read count consecutive blocks of a file into data. Safe to call from
+// several threads at once; reads of different files run in parallel.
+void fs_read_blocks(FsContext *fs, const char *path, int block_num, int count, void *data) {
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    int found = find_file_range(fs, path, block_num, count);
+    if (found != -1) {
+        pthread_rwlock_rdlock(&fs->inode_lock[found]);
+        read_file_blocks(fs, found, block_num, count, data);
+        pthread_rwlock_unlock(&fs->inode_lock[found]);
+    }
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Read count blocks of a file starting at its block block_num, with one
+// transfer per contiguous run. Stale blocks read as zeros.
+static void read_file_blocks(FsContext *fs, int inode_idx, int block_num, int count, char *data) {
+    int next = block_num + count;
+    int sequential = __atomic_exchange_n(&fs->read_next[inode_idx], next, __ATOMIC_RELAXED) == block_num;
+    while (count > 0) {
+        int run;
+        int block = map_block(fs, inode_idx, block_num, &run);
+        if (run <= 0) {
+            memset(data, 0, (size_t)count * FS_BLOCK_SIZE);
+            return;
+        }
+        if (run > count) run = count;
+
+        cache_read(fs, block, data, run);
+        for (int i = 0; i < run; i++) {
+            if (fs->stale_block[block + i]) {
+                memset(data + i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            }
+        }
+        data += run * FS_BLOCK_SIZE;
+        block_num += run;
+        count -= run;
+    }
+    if (sequential && fs->cache_capacity > 1) read_ahead(fs, inode_idx, next);
+}
+
+// Fetch the blocks of a file that follow block_num and lie in the same
+// contiguous run, up to READ_AHEAD_BLOCKS and half the cache
+static void read_ahead(FsContext *fs, int inode_idx, int block_num) {
+    int size = fs->superblock.inode[inode_idx].used_size & FIELD_MASK;
+    if (block_num >= size) return;
+
+    int run;
+    int block = map_block(fs, inode_idx, block_num, &run);
+    int limit = fs->cache_capacity / 2 < READ_AHEAD_BLOCKS ? fs->cache_capacity / 2 : READ_AHEAD_BLOCKS;
+    if (run > limit) run = limit;
+    if (run > 0) cache_prefetch(fs, block, run);
+}
+
+void fs_write(FsContext *fs, const char *path, int block_num) {
+    fs_write_range(fs, path, block_num, 1);
+}
+
+// Write the first count blocks of the buffer to a file in one transfer
+void fs_write_range(FsContext *fs, const char *path, int block_num, int count) {
+    fs_write_blocks(fs, path, block_num, count, fs->buffer);
+}
+
+// Write count blocks of data to consecutive blocks of a file. Safe to call
+// from several threads at once, like fs_read_blocks.
+void fs_write_blocks(FsContext *fs, const char *path, int block_num, int count, const void *data) {
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    int found = find_file_range(fs, path, block_num, count);
+    if (found != -1) write_file_blocks(fs, found, block_num, count, data);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Write count blocks of data to a file starting at its block block_num,
+// one transfer per contiguous run. The caller holds meta_lock.
+static void write_file_blocks(FsContext *fs, int inode_idx, int block_num, int count, const char *data) {
+    pthread_rwlock_wrlock(&fs->inode_lock[inode_idx]);
+    while (count > 0) {
+        int run;
+        int block = map_block(fs, inode_idx, block_num, &run);
+        if (run <= 0) break;
+        if (run > count) run = count;
+
+        snapshot_preserve(fs, block, run);
+        cache_write(fs, block, data, run);
+        memset(fs->stale_block + block, 0, run);
+        data += run * FS_BLOCK_SIZE;
+        block_num += run;
+        count -= run;
+    }
+    pthread_rwlock_unlock(&fs->inode_lock[inode_idx]);
+}
+
+// Replace the first block of the buffer with len bytes of data, zero padded
+static void set_buffer(FsContext *fs, const char *data, int len) {
+    memset(fs->buffer, 0, FS_BLOCK_SIZE);
+    if (len > 0) memcpy(fs->buffer, data, len < FS_BLOCK_SIZE ? len : FS_BLOCK_SIZE);
+}
+
+void fs_buff(FsContext *fs, char buff[1024]) {
+    set_buffer(fs, buff, buff ? (int)strnlen(buff, 1024) : 0);
+}
+
+static void list_dir(FsContext *fs) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    // Count valid entries in current directory
+    int current_items = fs->child_count[fs->current_dir_inode];
+
+    // Print current directory
+    fprintf(fs->out, "%-5s %3d\n", ".", current_items + 2);
+
+    // Print parent directory
+    if (fs->current_dir_inode == 0) {
+        fprintf(fs->out, "%-5s %3d\n", "..", current_items + 2);
+    } else {
+        int parent_idx = fs->superblock.inode[fs->current_dir_inode].dir_parent & FIELD_MASK;
+        int parent_items = fs->child_count[parent_idx];
+        fprintf(fs->out, "%-5s %3d\n", "..", parent_items + 2);
+    }
+
+    // Print all other entries
+    for (int i = fs->first_child[fs->current_dir_inode]; i != -1; i = fs->next_sibling[i]) {
+        if (fs->superblock.inode[i].dir_parent & INODE_FLAG) { // Directory
+            fprintf(fs->out, "%-5s %3d\n", fs->superblock.inode[i].name, fs->child_count[i] + 2);
+        } else { // File
+            int size = fs->superblock.inode[i].used_size & FIELD_MASK;
+            fprintf(fs->out, "%-5s %3d KB\n", fs->superblock.inode[i].name, 
+                   (int)((size_t)size * FS_BLOCK_SIZE / 1024));
+        }
+    }
+}
+
+void fs_ls(FsContext *fs) {
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    list_dir(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+static void resize_file(FsContext *fs, const char *path, int new_size) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    // Find the file
+    char name[6];
+    int dir = split_path(fs, path, name);
+    if (dir == -1) return;
+    int found = find_inode(fs, dir, name, 0);
+
+    if (found == -1) {
+        fprintf(fs->err, "Error: File %s does not exist\n", name);
+        return;
+    }
+
+    int current_size = fs->superblock.inode[found].used_size & FIELD_MASK;
+    int start_block = fs->superblock.inode[found].start_block;
+    int mapped = start_block & EXTENT_MAPPED;
+    int grow = new_size - current_size;
+
+    if (grow > 0 && mapped) {
+        // Mapped files grow in place with as many extents as it takes
+        if (count_free_blocks(fs) < grow) {
+            fprintf(fs->err, "Error: File %s cannot expand to size %d\n", name, new_size);
+            return;
+        }
+        if (allocate_extents(fs, found, grow) == -1) {
+            truncate_extents(fs, found, current_size);
+            fprintf(fs->err, "Error: File %s cannot expand to size %d\n", name, new_size);
+            return;
+        }
+    } else if (grow > 0) {
+        // Try to expand in place
+        int can_expand = start_block + new_size <= FS_BLOCK_COUNT &&
+                         next_block(fs, start_block + current_size, 1) >= start_block + new_size;
+
+        if (!can_expand && use_extents && count_free_blocks(fs) > grow) {
+            // Map the file and grow it in place instead of moving it
+            fs->extent[found][0].start = start_block;
+            fs->extent[found][0].count = current_size;
+            fs->extent_count[found] = 1;
+            if (allocate_extents(fs, found, grow) == -1) {
+                truncate_extents(fs, found, current_size);
+                fs->extent_count[found] = 0;
+                fprintf(fs->err, "Error: File %s cannot expand to size %d\n", name, new_size);
+                return;
+            }
+            fs->superblock.inode[found].start_block = EXTENT_MAPPED | take_free_block(fs);
+            mapped = 1;
+        } else if (!can_expand) {
+            // Find new location
+            int new_start = find_contiguous_blocks(fs, new_size);
+            if (new_start == -1) {
+                fprintf(fs->err, "Error: File %s cannot expand to size %d\n", name, new_size);
+                return;
+            }
+
+            // Copy data to new location and update block allocation
+            io_batch_begin(fs);
+            move_blocks(fs, new_start, start_block, current_size);
+            mark_blocks(fs, start_block, current_size, 0);  // Free old blocks
+            mark_blocks(fs, new_start, new_size, 1);  // Mark new blocks as used
+            fs->superblock.inode[found].start_block = new_start;
+            fs->superblock.inode[found].used_size = INODE_FLAG | (new_size & FIELD_MASK);
+
+            // Zero out old blocks once the new location is journaled
+            journal_write_ahead(fs);
+            release_blocks(fs, start_block, current_size);
+            io_batch_end(fs);
+        } else {
+            // Mark additional blocks as used
+            mark_blocks(fs, start_block + current_size, new_size - current_size, 1);
+        }
+    } else if (grow < 0 && mapped) {
+        truncate_extents(fs, found, new_size);
+    } else if (grow < 0) {
+        // Shrink file
+        release_blocks(fs, start_block + new_size, current_size - new_size);
+        mark_blocks(fs, start_block + new_size, current_size - new_size, 0);
+    }
+
+    // Update inode size
+    fs->superblock.inode[found].used_size = INODE_FLAG | (new_size & FIELD_MASK);
+    if (mapped && grow != 0) finish_extent_map(fs, found);
+    write_superblock(fs);
+}
+
+void fs_resize(FsContext *fs, const char *path, int new_size) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    resize_file(fs, path, new_size);
+    end_update(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Order by start block, then inode, as the stable sort it replaces did
+static int compare_files(const void *a, const void *b) {
+    const FileInfo *fa = a;
+    const FileInfo *fb = b;
+    if (fa->start_block != fb->start_block) {
+        return fa->start_block - fb->start_block;
+    }
+    return fa->inode_idx - fb->inode_idx;
+}
+
+static void defrag_disk(FsContext *fs) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    // Collect files and sort them by start block. Extent-mapped files are
+    // read into memory instead (start_block is then their offset there) and
+    // written back as contiguous files after all the others.
+    FileInfo files[FS_INODE_COUNT];
+    FileInfo mapped[FS_INODE_COUNT];
+    int file_count = 0;
+    int mapped_count = 0;
+    int staged_count = 0;
+    int packed_end = FIRST_DATA_BLOCK;  // First block past the packed files
+
+    // Room for the staged files, and for their old extents and map blocks,
+    // which are freed once the files are written back
+    size_t staged_blocks = 0;
+    size_t old_extents = 0;
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w] & ~fs->inode_dir[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            const Inode *inode = &fs->superblock.inode[i];
+            if (inode->start_block & EXTENT_MAPPED) {
+                staged_blocks += inode->used_size & FIELD_MASK;
+                old_extents += fs->extent_count[i] + 1;
+            }
+        }
+    }
+    char *staged = staged_blocks ? malloc(staged_blocks * FS_BLOCK_SIZE) : NULL;
+    Extent *old = old_extents ? malloc(old_extents * sizeof(Extent)) : NULL;
+    if ((staged_blocks && !staged) || (old_extents && !old)) {
+        free(staged);
+        free(old);
+        fprintf(fs->err, "Error: Not enough memory to defragment %s\n", fs->current_disk);
+        return;
+    }
+
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w] & ~fs->inode_dir[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            int size = fs->superblock.inode[i].used_size & FIELD_MASK;
+            if (fs->superblock.inode[i].start_block & EXTENT_MAPPED) {
+                mapped[mapped_count].inode_idx = i;
+                mapped[mapped_count].start_block = staged_count;
+                mapped[mapped_count].size = size;
+                read_file_blocks(fs, i, 0, size, staged + staged_count * FS_BLOCK_SIZE);
+                staged_count += size;
+                mapped_count++;
+            } else {
+                files[file_count].inode_idx = i;
+                files[file_count].start_block = fs->superblock.inode[i].start_block;
+                files[file_count].size = size;
+                file_count++;
+            }
+            packed_end += size;
+        }
+    }
+    qsort(files, file_count, sizeof(FileInfo), compare_files);
+
+    // Files that are already adjacent keep moving together, so each run of
+    // them is copied as one extent. Only the part of an old extent that
+    // lies past packed_end ends up free; everything below it is overwritten.
+    int next_free = FIRST_DATA_BLOCK;  // Start after superblock
+    io_batch_begin(fs);
+    for (int i = 0; i < file_count; ) {
+        int src = files[i].start_block;
+        int run = i + 1;
+        int run_size = files[i].size;
+        while (run < file_count && files[run].start_block == src + run_size) {
+            run_size += files[run].size;
+            run++;
+        }
+
+        if (src != next_free) {
+            move_blocks(fs, next_free, src, run_size);
+            mark_blocks(fs, src, run_size, 0);
+            mark_blocks(fs, next_free, run_size, 1);
+
+            for (int j = i; j < run; j++) {
+                fs->superblock.inode[files[j].inode_idx].start_block = 
+                    next_free + files[j].start_block - src;
+            }
+
+            // Only zero the old extent once the move is journaled
+            journal_write_ahead(fs);
+            int zero_start = src > packed_end ? src : packed_end;
+            release_blocks(fs, zero_start, src + run_size - zero_start);
+        }
+
+        next_free += run_size;
+        i = run;
+    }
+    io_batch_end(fs);
+
+    // The staged files overwrite whatever is left below packed_end, so only
+    // the parts of their old blocks past it end up free
+    if (mapped_count > 0) {
+        int old_count = 0;
+        for (int m = 0; m < mapped_count; m++) {
+            int inode_idx = mapped[m].inode_idx;
+            int size = mapped[m].size;
+            memcpy(old + old_count, fs->extent[inode_idx], 
+                   fs->extent_count[inode_idx] * sizeof(Extent));
+            old_count += fs->extent_count[inode_idx];
+            old[old_count].start = fs->superblock.inode[inode_idx].start_block & FIELD_MASK;
+            old[old_count].count = old[old_count].start ? 1 : 0;
+            old_count++;
+
+            snapshot_preserve(fs, next_free, size);
+            cache_write(fs, next_free, staged + mapped[m].start_block * FS_BLOCK_SIZE, size);
+            STAT_ADD(fs, blocks_moved, size);
+            memset(fs->stale_block + next_free, 0, size);
+            mark_blocks(fs, next_free, size, 1);
+            fs->superblock.inode[inode_idx].start_block = next_free;
+            fs->extent_count[inode_idx] = 0;
+            next_free += size;
+        }
+
+        journal_write_ahead(fs);
+        for (int e = 0; e < old_count; e++) {
+            int start = (int)old[e].start > packed_end ? (int)old[e].start : packed_end;
+            int end = old[e].start + old[e].count;
+            if (end > start) {
+                mark_blocks(fs, start, end - start, 0);
+                release_blocks(fs, start, end - start);
+            }
+        }
+    }
+    free(staged);
+    free(old);
+
+    write_superblock(fs);
+}
+
+void fs_defrag(FsContext *fs) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    defrag_disk(fs);
+    end_update(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Contiguous file whose first block is block, or -1
+static int file_at_block(FsContext *fs, int block) {
+    for (int w = 0; w < INODE_WORDS; w++) {
+        for (uint64_t bits = fs->inode_used[w] & ~fs->inode_dir[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            const Inode *inode = &fs->superblock.inode[i];
+            if ((int)inode->start_block == block && (inode->used_size & FIELD_MASK) > 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// The incremental form of defrag_disk: slide contiguous files, lowest
+// first and one at a time, down into the free gap before them, as long as
+// they fit in what is left of budget. Blocks of extent-mapped files stay
+// where they are and are stepped over. With need > 0 it stops as soon as
+// there is a free run of need blocks. Returns the blocks moved, and sets
+// *done once no file is left that could move down.
+static int compact_blocks(FsContext *fs, int budget, int need, int *done) {
+    int moved = 0;
+    int largest = 0;
+    *done = 0;
+
+    io_batch_begin(fs);
+    int gap = next_block(fs, FIRST_DATA_BLOCK, 0);
+    while (!need || (free_extents(fs, &largest), largest < need)) {
+        int src = next_block(fs, gap, 1);
+        if (src == FS_BLOCK_COUNT) {
+            *done = 1;
+            break;
+        }
+        int inode_idx = file_at_block(fs, src);
+        if (inode_idx == -1) {
+            gap = next_block(fs, src, 0);
+            continue;
+        }
+        int size = fs->superblock.inode[inode_idx].used_size & FIELD_MASK;
+        if (size > budget - moved) break;
+
+        move_blocks(fs, gap, src, size);
+        mark_blocks(fs, src, size, 0);
+        mark_blocks(fs, gap, size, 1);
+        fs->superblock.inode[inode_idx].start_block = gap;
+
+        // As in defrag_disk, only the part of the old extent that the file
+        // no longer covers is released, once the move is journaled
+        journal_write_ahead(fs);
+        int zero_start = src > gap + size ? src : gap + size;
+        release_blocks(fs, zero_start, src + size - zero_start);
+        moved += size;
+        gap += size;
+    }
+    io_batch_end(fs);
+
+    if (moved > 0) write_superblock(fs);
+    return moved;
+}
+
+static void compact_step(FsContext *fs) {
+    if (!fs->current_disk || fs->compact_budget == 0) return;
+    if (fragmentation_score(fs) <= fs->compact_threshold) {
+        fs->compact_credit = 0;
+        return;
+    }
+
+    // Saving up never goes past what the largest file needs
+    int cap = fs->compact_budget > MAX_FILE_BLOCKS ? fs->compact_budget : MAX_FILE_BLOCKS;
+    fs->compact_credit += fs->compact_budget;
+    if (fs->compact_credit > cap) fs->compact_credit = cap;
+
+    int done;
+    int moved = compact_blocks(fs, fs->compact_credit, 0, &done);
+    fs->compact_credit = done ? 0 : fs->compact_credit - moved;
+    if (moved > 0) end_update(fs);
+}
+
+void fs_compact(FsContext *fs, int budget, int threshold) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    __atomic_store_n(&fs->compact_budget, budget, __ATOMIC_RELAXED);
+    fs->compact_threshold = threshold;
+    fs->compact_credit = 0;
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_compact_step(FsContext *fs) {
+    // Runs after every command, so skip the lock while compaction is off
+    if (__atomic_load_n(&fs->compact_budget, __ATOMIC_RELAXED) == 0) return;
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    compact_step(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_snapshot(FsContext *fs) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    take_snapshot(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_rollback(FsContext *fs) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    rollback_snapshot(fs);
+    end_update(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_discard_snapshot(FsContext *fs) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+    } else if (!fs->snapshot_active) {
+        fprintf(fs->err, "Error: No snapshot of %s to discard\n", fs->current_disk);
+    } else {
+        snapshot_discard(fs);
+    }
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_sync(FsContext *fs) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+    } else {
+        settle_disk(fs);
+        if (fs->disk_map) {
+            STAT_ADD(fs, syscalls, 1);
+            msync(fs->disk_map, DISK_BYTES, MS_SYNC);
+        }
+    }
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_scrub(FsContext *fs) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+    } else {
+        zero_stale_blocks(fs, 1);
+    }
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+void fs_alloc(FsContext *fs, char *policy) {
+    int parsed = parse_alloc_policy(policy);
+    if (parsed == -1) {
+        fprintf(fs->err, "Error: Unknown allocation policy %s\n", policy);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    fs->alloc_policy = parsed;
+    fs->next_fit_cursor = FIRST_DATA_BLOCK;
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Number of free extents, and the length of the largest one
+static int free_extents(FsContext *fs, int *largest) {
+    int extents = 0;
+    *largest = 0;
+    for (int start = next_block(fs, FIRST_DATA_BLOCK, 0); start < FS_BLOCK_COUNT; ) {
+        int end = next_block(fs, start, 1);
+        extents++;
+        if (end - start > *largest) *largest = end - start;
+        start = next_block(fs, end, 0);
+    }
+    return extents;
+}
+
+// Share of free space outside the largest free extent
+static int fragmentation_score(FsContext *fs) {
+    int free_blocks = count_free_blocks(fs);
+    int largest;
+    free_extents(fs, &largest);
+    return free_blocks ? 100 - largest * 100 / free_blocks : 0;
+}
+
+static void report_frag(FsContext *fs) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    int free_blocks = count_free_blocks(fs);
+    int largest;
+    int extents = free_extents(fs, &largest);
+
+    // Same measure as fragmentation_score
+    int fragmentation = free_blocks ? 100 - largest * 100 / free_blocks : 0;
+    fprintf(fs->out, "policy %s, free %d, extents %d, largest %d, fragmentation %d%%\n",
+           alloc_policy_names[fs->alloc_policy], free_blocks, extents, largest, fragmentation);
+}
+
+void fs_frag(FsContext *fs) {
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    report_frag(fs);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+static unsigned long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long stat_load(const unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Shared by T and the report --stats prints at exit
+static void print_stats(FsContext *fs, FILE *stream) {
+    const FsStats *stats = &fs->stats;
+    pthread_mutex_lock(&fs->cache_lock);
+    fprintf(stream, "cache %d blocks, %lu hits, %lu misses, %lu read ahead\n", 
+           fs->cache_capacity, fs->cache_hits, fs->cache_misses, fs->cache_read_ahead);
+    pthread_mutex_unlock(&fs->cache_lock);
+
+    int listed = 0;
+    fprintf(stream, "commands");
+    for (int c = 0; c < 26; c++) {
+        unsigned long n = stat_load(&stats->commands[c]);
+        if (n == 0) continue;
+        fprintf(stream, "%s %c %lu", listed++ ? "," : "", 'A' + c, n);
+    }
+    fprintf(stream, "%s\n", listed ? "" : " none");
+
+    if (collect_stats && listed) {
+        listed = 0;
+        fprintf(stream, "time");
+        for (int c = 0; c < 26; c++) {
+            if (stat_load(&stats->commands[c]) == 0) continue;
+            fprintf(stream, "%s %c %lu us", listed++ ? "," : "", 'A' + c, 
+                    stat_load(&stats->command_ns[c]) / 1000);
+        }
+        fprintf(stream, "\n");
+    }
+
+    fprintf(stream, "io %lu syscalls, %lu bytes read, %lu bytes written\n", 
+            stat_load(&stats->syscalls), stat_load(&stats->bytes_read), stat_load(&stats->bytes_written));
+    fprintf(stream, "blocks %lu zeroed, %lu moved, %lu punched, %lu read from holes\n", 
+            stat_load(&stats->blocks_zeroed), stat_load(&stats->blocks_moved), 
+            stat_load(&stats->blocks_punched), stat_load(&stats->hole_reads));
+    fprintf(stream, "search %lu inode scans, %lu allocation probes\n", 
+            stat_load(&stats->inode_scans), stat_load(&stats->alloc_probes));
+    fprintf(stream, "paths %lu cached, %lu walked\n", 
+            stat_load(&stats->path_hits), stat_load(&stats->path_walks));
+}
+
+void fs_stats(FsContext *fs) {
+    print_stats(fs, fs->out);
+}
+
+// The directory that name leads to from dir, or -1 if there is none
+static int step_dir(FsContext *fs, int dir, const char *name) {
+    if (strcmp(name, ".") == 0) {
+        return dir;  
+    }
+    
+    if (strcmp(name, "..") == 0) {
+        if (dir != 0) {  // Not root directory
+            int parent = fs->superblock.inode[dir].dir_parent & FIELD_MASK;
+            if (parent != ROOT_PARENT) {  // Not root
+                return parent;
+            }
+        }
+        return dir;
+    }
+
+    // Find directory in dir
+    return find_inode(fs, dir, name, 1);
+}
+
+// Walk the first len bytes of path, one directory per component, starting
+// from the top directory if it begins with a slash. Walks that succeed are
+// cached. Returns the directory reached, or -1 after reporting the first
+// component that is not a directory.
+static int resolve_dir(FsContext *fs, const char *path, int len) {
+    int base = path[0] == '/' ? 0 : fs->current_dir_inode;
+    PathEntry *entry = NULL;
+    if (len <= PATH_CACHE_KEY) {
+        uint64_t hash = fnv1a(0xcbf29ce484222325ULL, path, len) ^ (uint64_t)base * 0x9E3779B97F4A7C15ULL;
+        entry = &fs->path_cache[(hash >> 32) & (PATH_CACHE_SIZE - 1)];
+        pthread_mutex_lock(&fs->path_lock);
+        int hit = entry->generation == fs->path_generation && entry->base == base && 
+                  entry->len == len && memcmp(entry->path, path, len) == 0;
+        int dir = entry->dir;
+        pthread_mutex_unlock(&fs->path_lock);
+        if (hit) {
+            STAT_ADD(fs, path_hits, 1);
+            return dir;
+        }
+    }
+    STAT_ADD(fs, path_walks, 1);
+
+    int dir = base;
+    for (int i = 0; i < len; ) {
+        while (i < len && path[i] == '/') i++;
+        int n = 0;
+        while (i + n < len && path[i + n] != '/') n++;
+        if (n == 0) break;
+
+        char name[6];
+        if (n <= 5) {
+            memcpy(name, path + i, n);
+            name[n] = '\0';
+        }
+        int next = n <= 5 ? step_dir(fs, dir, name) : -1;
+        if (next == -1) {
+            fprintf(fs->err, "Error: Directory %.*s does not exist\n", n, path + i);
+            return -1;
+        }
+        dir = next;
+        i += n;
+    }
+
+    if (entry) {
+        pthread_mutex_lock(&fs->path_lock);
+        entry->generation = fs->path_generation;
+        entry->base = base;
+        entry->dir = dir;
+        entry->len = len;
+        memcpy(entry->path, path, len);
+        pthread_mutex_unlock(&fs->path_lock);
+    }
+    return dir;
+}
+
+// Split path into the directory holding its last component, which is
+// returned, and that component, copied to name. A plain name stays in the
+// current directory. name is padded with NULs. Returns -1 after an error.
+static int split_path(FsContext *fs, const char *path, char name[6]) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        strncpy(name, path, 5);
+        name[5] = '\0';
+        return fs->current_dir_inode;
+    }
+
+    const char *last = slash + 1;
+    size_t len = strlen(last);
+    if (len == 0 || len > 5 || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+        fprintf(fs->err, "Error: Invalid path %s\n", path);
+        return -1;
+    }
+    strncpy(name, last, 5);
+    name[5] = '\0';
+    return resolve_dir(fs, path, slash == path ? 1 : (int)(slash - path));
+}
+
+static void change_dir(FsContext *fs, const char *path) {
+    if (!fs->current_disk) {
+        fprintf(fs->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    if (strchr(path, '/')) {
+        int found = resolve_dir(fs, path, (int)strlen(path));
+        if (found != -1) fs->current_dir_inode = found;
+        return;
+    }
+
+    // Find directory in current directory
+    int found = step_dir(fs, fs->current_dir_inode, path);
+
+    if (found == -1) {
+        fprintf(fs->err, "Error: Directory %s does not exist\n", path);
+        return;
+    }
+
+    fs->current_dir_inode = found;
+}
+
+void fs_cd(FsContext *fs, const char *path) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    change_dir(fs, path);
+    pthread_rwlock_unlock(&fs->meta_lock);
+}
+
+// Command file parsing. The whole file is mapped (or read in one go) and
+// each line is decoded in place into a Command: only names are copied out.
+// Lines are split exactly as fgets with a 1 KB buffer would split them, so
+// overlong lines count as several, and arguments follow the sscanf
+// directives the commands were defined with, so diagnostics are unchanged.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t pos;
+    int line_num;
+    int mapped;
+} CommandReader;
+
+typedef struct {
+    char op;              // Command letter, or 0 when the line is malformed
+    int line_num;
+    char name[6];         // NUL-terminated file or directory name
+    int arg1;             // Size or block number
+    int arg2;             // Block count of a range read or write
+    const char *text;     // Disk name, policy, buffer contents or path, not terminated
+    int text_len;
+} Command;
+
+static int open_commands(const char *path, CommandReader *reader) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->data = map;
+            reader->size = st.st_size;
+            reader->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+
+    // Pipes and the like are read in large blocks instead
+    size_t capacity = 0;
+    for (;;) {
+        if (reader->size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            char *grown = realloc(reader->data, capacity);
+            if (!grown) break;
+            reader->data = grown;
+        }
+        ssize_t got = read(fd, reader->data + reader->size, capacity - reader->size);
+        if (got <= 0) break;
+        reader->size += got;
+    }
+    close(fd);
+    return 0;
+}
+
+static void close_commands(CommandReader *reader) {
+    if (reader->mapped) {
+        munmap(reader->data, reader->size);
+    } else {
+        free(reader->data);
+    }
+}
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+// Like %s (max 0) or %<max>s: 1 on success, -1 at end of input
+static int scan_word(const char **p, const char *end, int max,
+                     const char **word, int *len) {
+    const char *q = skip_space(*p, end);
+    if (q == end) return -1;
+    *word = q;
+    while (q < end && !isspace((unsigned char)*q) && (max == 0 || q - *word < max)) q++;
+    *len = (int)(q - *word);
+    *p = q;
+    return 1;
+}
+
+// Like %d, including its saturate-then-truncate handling of overflow:
+// 1 on success, 0 without digits, -1 at end of input
+static int scan_int(const char **p, const char *end, int *value) {
+    const char *q = skip_space(*p, end);
+    if (q == end) return -1;
+
+    int negative = 0;
+    if (*q == '+' || *q == '-') negative = *q++ == '-';
+    if (q == end || !isdigit((unsigned char)*q)) return 0;
+
+    unsigned long magnitude = 0;
+    int overflow = 0;
+    for (; q < end && isdigit((unsigned char)*q); q++) {
+        if (magnitude > (ULONG_MAX - (*q - '0')) / 10) overflow = 1;
+        else magnitude = magnitude * 10 + (*q - '0');
+    }
+
+    long result;
+    if (negative) {
+        result = overflow || magnitude > (unsigned long)LONG_MAX + 1 ? LONG_MIN : -(long)magnitude;
+    } else {
+        result = overflow || magnitude > LONG_MAX ? LONG_MAX : (long)magnitude;
+    }
+    *value = (int)result;
+    *p = q;
+    return 1;
+}
+
+static int scan_name(const char **p, const char *end, char name[6]) {
+    const char *word;
+    int len;
+    if (scan_word(p, end, 5, &word, &len) != 1) return 0;
+    memcpy(name, word, len);
+    name[len] = '\0';
+    return 1;
+}
+
+// A word with a slash in it is a path, kept whole in text; anything else
+// is a name, scanned as before
+static int scan_target(const char **p, const char *end, Command *cmd) {
+    const char *q = *p;
+    const char *word;
+    int len;
+    if (scan_word(&q, end, 0, &word, &len) == 1 && memchr(word, '/', len)) {
+        cmd->text = word;
+        cmd->text_len = len;
+        *p = q;
+        return 1;
+    }
+    return scan_name(p, end, cmd->name);
+}
+
+// Whether the numeric arguments of a decoded command are in range
+static int command_args_ok(const Command *cmd) {
+    switch (cmd->op) {
+        case 'C':
+            return cmd->arg1 >= 0 && cmd->arg1 <= MAX_FILE_BLOCKS;
+        case 'E':
+            return cmd->arg1 > 0 && cmd->arg1 <= MAX_FILE_BLOCKS;
+        case 'R':
+        case 'W':
+            return cmd->arg1 >= 0 && cmd->arg1 <= MAX_FILE_BLOCKS - 1 && 
+                   cmd->arg2 >= 1 && cmd->arg2 <= MAX_RANGE_BLOCKS && 
+                   cmd->arg1 + cmd->arg2 <= MAX_FILE_BLOCKS;
+        case 'G':
+            return cmd->arg1 >= 0 && cmd->arg1 <= FS_BLOCK_COUNT && 
+                   cmd->arg2 >= 0 && cmd->arg2 <= 100;
+        default:
+            return 1;
+    }
+}
+
+// Decode the next non-empty line; returns 0 at end of input
+static int next_command(CommandReader *reader, Command *cmd) {
+    while (reader->pos < reader->size) {
+        // One fgets call: up to 1023 bytes, through the newline if it fits
+        const char *line = reader->data + reader->pos;
+        size_t avail = reader->size - reader->pos;
+        size_t chunk = avail < 1023 ? avail : 1023;
+        const char *newline = memchr(line, '\n', chunk);
+        if (newline) chunk = newline - line + 1;
+        reader->pos += chunk;
+        reader->line_num++;
+
+        // The line ends at the newline or at an embedded NUL
+        const char *nul = memchr(line, '\0', chunk);
+        const char *end = nul ? nul : newline ? newline : line + chunk;
+        if (end == line) continue;  // Skip empty lines
+
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->op = line[0];
+        cmd->line_num = reader->line_num;
+        int len = (int)(end - line);
+        const char *p = line + 1;
+        int ok = 1;
+
+        switch (line[0]) {
+            case 'M':  // The disk name is taken from the third character on
+                p = len > 2 ? line + 2 : end;
+                ok = scan_word(&p, end, 0, &cmd->text, &cmd->text_len) == 1;
+                break;
+
+            case 'C':
+            case 'E':
+                ok = scan_target(&p, end, cmd) && scan_int(&p, end, &cmd->arg1) == 1;
+                break;
+
+            case 'D':
+            case 'Y':
+                ok = scan_target(&p, end, cmd);
+                break;
+
+            case 'R':
+            case 'W':  // Optional third argument: number of consecutive blocks
+                cmd->arg2 = 1;
+                ok = scan_target(&p, end, cmd) && scan_int(&p, end, &cmd->arg1) == 1;
+                if (ok) scan_int(&p, end, &cmd->arg2);
+                break;
+
+            case 'B':  // Everything after "B " is the buffer contents
+                if (len > 2) {
+                    cmd->text = line + 2;
+                    cmd->text_len = len - 2;
+                }
+                break;
+
+            case 'A':
+                ok = scan_word(&p, end, 15, &cmd->text, &cmd->text_len) == 1;
+                break;
+
+            case 'G':  // Optional second argument: fragmentation threshold in percent
+                ok = scan_int(&p, end, &cmd->arg1) == 1;
+                if (ok) scan_int(&p, end, &cmd->arg2);
+                break;
+
+            case 'L':
+            case 'O':
+            case 'S':
+            case 'F':
+            case 'T':
+            case 'Z':
+            case 'N':
+            case 'U':
+            case 'X':
+                ok = len == 1;
+                break;
+
+            default:
+                ok = 0;
+                break;
+        }
+
+        if (!ok || !command_args_ok(cmd)) cmd->op = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Count a command that was run, with the time it took (0 if not timed)
+static void count_command(FsContext *fs, char op, unsigned long ns) {
+    STAT_ADD(fs, commands[op - 'A'], 1);
+    if (ns) STAT_ADD(fs, command_ns[op - 'A'], ns);
+}
+
+static void run_command(FsContext *fs, const Command *cmd, const char *cmd_path) {
+    unsigned long started = collect_stats ? clock_ns() : 0;
+    char text[1024];
+    if (cmd->text && cmd->op != 'B') {
+        memcpy(text, cmd->text, cmd->text_len);
+        text[cmd->text_len] = '\0';
+    }
+    const char *target = cmd->text ? text : cmd->name;
+
+    switch (cmd->op) {
+        case 'M': fs_mount(fs, text); break;
+        case 'C': fs_create(fs, target, cmd->arg1); break;
+        case 'D': fs_delete(fs, target, -1); break;
+        case 'R': fs_read_range(fs, target, cmd->arg1, cmd->arg2); break;
+        case 'W': fs_write_range(fs, target, cmd->arg1, cmd->arg2); break;
+        case 'B': set_buffer(fs, cmd->text, cmd->text_len); break;
+        case 'L': fs_ls(fs); break;
+        case 'E': fs_resize(fs, target, cmd->arg1); break;
+        case 'O': fs_defrag(fs); break;
+        case 'A': fs_alloc(fs, text); break;
+        case 'F': fs_frag(fs); break;
+        case 'G': fs_compact(fs, cmd->arg1, cmd->arg2); break;
+        case 'S': fs_sync(fs); break;
+        case 'T': fs_stats(fs); break;
+        case 'Z': fs_scrub(fs); break;
+        case 'N': fs_snapshot(fs); break;
+        case 'U': fs_rollback(fs); break;
+        case 'X': fs_discard_snapshot(fs); break;
+        case 'Y': fs_cd(fs, target); break;
+        default:
+            fprintf(fs->err, "Command Error: %s, %d\n", cmd_path, cmd->line_num);
+            return;
+    }
+    count_command(fs, cmd->op, collect_stats ? clock_ns() - started : 0);
+}
 
-    for (int i = 0; i < 128; i++) {
-        int is_used = get_block_bit(i);
-        if (i == 0) {
-            if (!is_used) return 6;
-        } else if (is_used != (block_usage[i] > 0)) {
-            return 6;
+// Batch mode. The command file is decoded into a vector up front, and
+// short patterns of commands are run as one operation with the same
+// output and the same end state as running them one by one:
+//  - B and single-block W commands whose W's fill consecutive blocks of one
+//    file are staged and written with a single transfer;
+//  - a C directly followed by a D of the same name is dropped when the D
+//    would delete exactly what the C created;
+//  - with write-through, a run of metadata commands flushes the superblock
+//    once at its end rather than after every command.
+static int load_commands(CommandReader *reader, Command **cmds) {
+    int count = 0;
+    int capacity = 0;
+    *cmds = NULL;
+    for (;;) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            Command *grown = realloc(*cmds, capacity * sizeof(Command));
+            if (!grown) {
+                free(*cmds);
+                *cmds = NULL;
+                return -1;
+            }
+            *cmds = grown;
         }
+        if (!next_command(reader, &(*cmds)[count])) return count;
+        count++;
     }
-    
-    return 0;
 }
 
-void fs_mount(char *new_disk_name) {
-    FILE *disk = fopen(new_disk_name, "rb");
-    if (!disk) {
-        fprintf(stderr, "Error: Cannot find disk %s\n", new_disk_name);
-        return;
+// Length of the run of B and single-block W commands at cmds whose W's
+// write consecutive blocks of one file, or 0 if fewer than two W's line up
+static int write_group_length(const Command *cmds, int count) {
+    int length = 0;
+    int writes = 0;
+    const char *name = NULL;
+    int next_block_num = 0;
+    for (int i = 0; i < count; i++) {
+        if (cmds[i].op == 'B') continue;
+        if (cmds[i].op != 'W' || cmds[i].text || cmds[i].arg2 != 1 || writes == MAX_RANGE_BLOCKS) break;
+        if (writes > 0 && (strcmp(cmds[i].name, name) != 0 || cmds[i].arg1 != next_block_num)) break;
+        name = cmds[i].name;
+        next_block_num = cmds[i].arg1 + 1;
+        writes++;
+        length = i + 1;
     }
+    return writes >= 2 ? length : 0;
+}
 
-    // Read superblock
-    fread(&superblock, sizeof(Superblock), 1, disk);
-    fclose(disk);
+// B and W do not change metadata, so the file is looked up once. Its
+// blocks are staged in order, and since block numbers only grow the ones
+// it has form a prefix of the run.
+static void run_write_group(FsContext *fs, const Command *cmds, int length) {
+    char staged[MAX_RANGE_BLOCKS * FS_BLOCK_SIZE];
+    const Command *first = cmds;
+    while (first->op != 'W') first++;
 
-    // Check consistency
-    int consistency = check_consistency();
-    if (consistency != 0) {
-        fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", 
-                new_disk_name, consistency);
-        return;
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    int found = fs->current_disk ? find_inode(fs, fs->current_dir_inode, first->name, 0) : -1;
+    int size = found == -1 ? 0 : fs->superblock.inode[found].used_size & FIELD_MASK;
+    int staged_count = 0;
+    for (int i = 0; i < length; i++) {
+        const Command *cmd = &cmds[i];
+        if (cmd->op == 'B') {
+            set_buffer(fs, cmd->text, cmd->text_len);
+        } else if (!fs->current_disk) {
+            fprintf(fs->err, "Error: No file system is mounted\n");
+        } else if (found == -1) {
+            fprintf(fs->err, "Error: File %s does not exist\n", cmd->name);
+        } else if (cmd->arg1 >= size) {
+            fprintf(fs->err, "Error: %s does not have block %d\n", cmd->name, cmd->arg1);
+        } else {
+            memcpy(staged + staged_count++ * FS_BLOCK_SIZE, fs->buffer, FS_BLOCK_SIZE);
+        }
     }
-
-    // Update current disk and directory
-    if (current_disk) free(current_disk);
-    current_disk = strdup(new_disk_name);
-    current_dir_inode = 0;
-
-    // Zero out buffer
-    memset(buffer, 0, 1024);
+    if (staged_count > 0) write_file_blocks(fs, found, first->arg1, staged_count, staged);
+    pthread_rwlock_unlock(&fs->meta_lock);
 }
 
-void fs_create(char name[5], int size) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
-    }
+// Whether "D name" right after "C name size" is certain to delete the new
+// inode and leave it as it found it: nothing of that name is visible yet,
+// the root quirk of find_inode does not hide the new entry, the free inode
+// is all zeros and, for a directory, no orphan names it as parent.
+static int delete_undoes_create(FsContext *fs, const Command *create) {
+    static const Inode empty_inode;
+    if (!fs->current_disk || fs->current_dir_inode == 0) return 0;
+    if (find_inode(fs, fs->current_dir_inode, create->name, -1) != -1) return 0;
 
-    // Find free inode
-    int inode_idx = find_free_inode();
-    if (inode_idx == -1) {
-        fprintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n", 
-                current_disk, name);
-        return;
-    }
+    int inode_idx = find_free_inode(fs);
+    if (inode_idx == -1) return 0;
+    if (memcmp(&fs->superblock.inode[inode_idx], &empty_inode, sizeof(Inode)) != 0) return 0;
+    return create->arg1 > 0 || fs->first_child[inode_idx] == -1;
+}
 
-    // Modify the free block finding logic
-    int start_block = 0;
-    if (size > 0) {  // File
-        start_block = find_contiguous_blocks(size);
+// Apply the net effect of such a pair: the allocator state, the release of
+// the blocks and the markings of the superblock. Returns 0 if the pair has
+// to run normally.
+static int elide_create_delete(FsContext *fs, const Command *create) {
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    int elided = delete_undoes_create(fs, create);
+    int size = create->arg1;
+    if (elided && size > 0) {
+        int start_block = find_contiguous_blocks(fs, size);
         if (start_block == -1) {
-            fprintf(stderr, "Error: Cannot allocate %d blocks on %s\n", size, current_disk);
-            return;
+            elided = 0;
+        } else {
+            release_blocks(fs, start_block, size);
         }
+    }
 
-        // Mark blocks as used
-        for (int i = 0; i < size; i++) {
-            set_block_bit(start_block + i, 1);
+    if (elided) {
+        if (!(fs->superblock.inode[fs->current_dir_inode].used_size & INODE_FLAG) ||
+            !(fs->superblock.inode[fs->current_dir_inode].dir_parent & INODE_FLAG)) {
+            fs->superblock_consistent = 0;
         }
+        write_superblock(fs);
+        end_update(fs);
     }
+    pthread_rwlock_unlock(&fs->meta_lock);
+    return elided;
+}
 
-    // Initialize inode with proper values
-    strncpy(superblock.inode[inode_idx].name, name, 5);
-    superblock.inode[inode_idx].used_size = 0x80 | (size & 0x7F);
-    superblock.inode[inode_idx].start_block = start_block;
-    superblock.inode[inode_idx].dir_parent = (size == 0 ? 0x80 : 0) | 
-                                           (current_dir_inode == 0 ? 127 : current_dir_inode);
-
-    write_superblock();
+static int is_metadata_command(char op) {
+    return op == 'C' || op == 'D' || op == 'E' || op == 'O' || op == 'U';
 }
 
-void fs_delete(char name[5], int inode_idx) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
-    }
+static void run_batch(FsContext *fs, const Command *cmds, int count, const char *cmd_path) {
+    int i = 0;
+    while (i < count) {
+        const Command *cmd = &cmds[i];
+        if (write_through && is_metadata_command(cmd->op)) fs->hold_flush = 1;
 
-    // Find the file/directory
-    int target_inode = inode_idx;
-    if (target_inode == -1) {
-        for (int i = 0; i < 126; i++) {
-            if ((superblock.inode[i].used_size & 0x80) && 
-                (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode &&
-                compare_inode_names(superblock.inode[i].name, name)) {
-                target_inode = i;
-                break;
+        // A coalesced run is counted command by command, and its time goes
+        // to its last command
+        unsigned long started = collect_stats ? clock_ns() : 0;
+        int length = write_group_length(cmd, count - i);
+        int coalesced = 1;
+        if (length > 0) {
+            run_write_group(fs, cmd, length);
+        } else if (cmd->op == 'C' && !cmd->text && i + 1 < count && cmds[i + 1].op == 'D' && 
+                   !cmds[i + 1].text && strcmp(cmd->name, cmds[i + 1].name) == 0 && 
+                   elide_create_delete(fs, cmd)) {
+            length = 2;
+        } else {
+            run_command(fs, cmd, cmd_path);
+            length = 1;
+            coalesced = 0;
+        }
+        if (coalesced) {
+            unsigned long ns = collect_stats ? clock_ns() - started : 0;
+            for (int k = 0; k < length; k++) {
+                count_command(fs, cmds[i + k].op, k == length - 1 ? ns : 0);
             }
         }
+        i += length;
+        fs_compact_step(fs);
+
+        if (fs->hold_flush && (i == count || !is_metadata_command(cmds[i].op))) {
+            pthread_rwlock_wrlock(&fs->meta_lock);
+            fs->hold_flush = 0;
+            flush_superblock(fs);
+            pthread_rwlock_unlock(&fs->meta_lock);
+        }
     }
+}
 
-    if (target_inode == -1) {
-        fprintf(stderr, "Error: File or directory %s does not exist\n", name);
-        return;
+// Replay one command file on a fresh context. Returns the exit status.
+static int run_stream(const char *cmd_path, FILE *out, FILE *err) {
+    FsContext *fs = fs_new(out, err);
+    if (!fs) {
+        fprintf(err, "Error: Cannot allocate a %d block cache\n", cache_blocks);
+        return 1;
     }
 
-    // Recursively delete directory contents
-    if (superblock.inode[target_inode].dir_parent & 0x80) {
-        for (int i = 0; i < 126; i++) {
-            if ((superblock.inode[i].used_size & 0x80) && 
-                (superblock.inode[i].dir_parent & 0x7F) == target_inode) {
-                fs_delete(superblock.inode[i].name, i);
-            }
+    CommandReader reader;
+    if (open_commands(cmd_path, &reader) == -1) {
+        fprintf(err, "Error: Cannot open command file %s\n", cmd_path);
+        fs_free(fs);
+        return 1;
+    }
+
+    int status = 0;
+    if (batch_mode) {
+        Command *cmds;
+        int count = load_commands(&reader, &cmds);
+        if (count == -1) {
+            fprintf(err, "Error: Cannot load command file %s\n", cmd_path);
+            status = 1;
+        } else {
+            run_batch(fs, cmds, count, cmd_path);
+            free(cmds);
         }
     } else {
-        int start = superblock.inode[target_inode].start_block;
-        int size = superblock.inode[target_inode].used_size & 0x7F;
-        
-        // Mark blocks as free
-        for (int i = 0; i < size; i++) {
-            set_block_bit(start + i, 0);
-        }
-
-        // Zero out blocks
-        FILE *disk = fopen(current_disk, "r+b");
-        if (disk) {
-            char zero_block[1024] = {0};
-            for (int i = 0; i < size; i++) {
-                fseek(disk, (start + i) * 1024, SEEK_SET);
-                fwrite(zero_block, 1024, 1, disk);
-            }
-            fclose(disk);
+        Command cmd;
+        while (next_command(&reader, &cmd)) {
+            run_command(fs, &cmd, cmd_path);
+            fs_compact_step(fs);
         }
     }
 
-    // Zero out the inode
-    memset(&superblock.inode[target_inode], 0, sizeof(Inode));
-    
-    // Write changes back to disk
-    write_superblock();
+    close_commands(&reader);
+    if (collect_stats) {
+        // Unmount first so the final write-back is counted too
+        unmount_disk(fs);
+        print_stats(fs, err);
+    }
+    fs_free(fs);
+    return status;
 }
 
-void fs_read(char name[5], int block_num) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
-    }
+// Parallel replay of several command files. Workers take the streams in
+// order, each with its own context and with its output captured, and the
+// output of a stream is printed once it and every stream before it have
+// finished, so it reads as if the files had been replayed one by one.
+typedef struct {
+    const char *cmd_path;
+    char *out_text;
+    char *err_text;
+    size_t out_len;
+    size_t err_len;
+    int status;
+    int done;
+} Stream;
 
-    int found = -1;
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            !(superblock.inode[i].dir_parent & 0x80) &&
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode &&
-            compare_inode_names(superblock.inode[i].name, name)) {
-            found = i;
-            break;
+typedef struct {
+    Stream *streams;
+    int count;
+    int next;                    // Next stream to hand out
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} ReplayPool;
+
+static void *replay_worker(void *arg) {
+    ReplayPool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int k = pool->next < pool->count ? pool->next++ : -1;
+        pthread_mutex_unlock(&pool->lock);
+        if (k == -1) return NULL;
+
+        Stream *stream = &pool->streams[k];
+        FILE *out = open_memstream(&stream->out_text, &stream->out_len);
+        FILE *err = open_memstream(&stream->err_text, &stream->err_len);
+        if (out && err) {
+            stream->status = run_stream(stream->cmd_path, out, err);
+        } else {
+            stream->status = 1;
         }
+        if (out) fclose(out);
+        if (err) fclose(err);
+
+        pthread_mutex_lock(&pool->lock);
+        stream->done = 1;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
     }
+}
 
-    if (found == -1) {
-        fprintf(stderr, "Error: File %s does not exist\n", name);
-        return;
+static int replay_parallel(char **cmd_paths, int count, int jobs) {
+    ReplayPool pool;
+    pool.streams = calloc(count, sizeof(Stream));
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    if (!pool.streams || !workers) {
+        fprintf(stderr, "Error: Cannot allocate %d replay streams\n", count);
+        free(pool.streams);
+        free(workers);
+        return 1;
+    }
+    pool.count = count;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+    for (int k = 0; k < count; k++) {
+        pool.streams[k].cmd_path = cmd_paths[k];
     }
 
-    int size = superblock.inode[found].used_size & 0x7F;
-    if (block_num < 0 || block_num >= size) {
-        fprintf(stderr, "Error: %s does not have block %d\n", name, block_num);
-        return;
+    int started = 0;
+    while (started < jobs && pthread_create(&workers[started], NULL, replay_worker, &pool) == 0) {
+        started++;
+    }
+    if (started == 0) replay_worker(&pool);
+
+    int status = 0;
+    for (int k = 0; k < count; k++) {
+        Stream *stream = &pool.streams[k];
+        pthread_mutex_lock(&pool.lock);
+        while (!stream->done) pthread_cond_wait(&pool.finished, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!stream->out_text || !stream->err_text) {
+            fprintf(stderr, "Error: Cannot capture output of %s\n", stream->cmd_path);
+        }
+        if (stream->out_text) fwrite(stream->out_text, 1, stream->out_len, stdout);
+        if (stream->err_text) fwrite(stream->err_text, 1, stream->err_len, stderr);
+        free(stream->out_text);
+        free(stream->err_text);
+        status |= stream->status;
     }
 
-    FILE *disk = fopen(current_disk, "rb");
-    if (disk) {
-        int actual_block = superblock.inode[found].start_block + block_num;
-        fseek(disk, actual_block * 1024, SEEK_SET);
-        fread(buffer, 1024, 1, disk);
-        fclose(disk);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
     }
+    pthread_cond_destroy(&pool.finished);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(pool.streams);
+    return status;
 }
 
-void fs_write(char name[5], int block_num) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
+// Daemon mode: one context serves requests framed as in fs-sim.h, from
+// standard input or from each connection to a Unix socket in turn, so its
+// disks stay mounted from one batch to the next. Commands run as they do
+// in a command file, but what they print is captured and returned as the
+// payload of the reply, R returns the blocks it read and W can carry its
+// own.
+#define SERVE_OPS "MCDRWBLEOAFSTZNUXYG"
+#define SERVE_PAYLOAD_MAX (MAX_RANGE_BLOCKS * FS_BLOCK_SIZE)
+
+typedef struct {
+    FsContext *fs;
+    FILE *out;
+    FILE *err;
+    char *out_text;
+    char *err_text;
+    size_t out_len;
+    size_t err_len;
+    char payload[SERVE_PAYLOAD_MAX];   // Data of W and B
+} Server;
+
+static volatile sig_atomic_t serve_stop;
+
+static void stop_serving(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+// 1 once len bytes are read, 0 at end of input before the first, -1 on
+// an error or a short read
+static int read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = read(fd, (char *)buf + done, len - done);
+        if (got == -1 && errno == EINTR && !serve_stop) continue;
+        if (got <= 0) return got == 0 && done == 0 ? 0 : -1;
+        done += got;
     }
+    return 1;
+}
 
-    int found = -1;
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            !(superblock.inode[i].dir_parent & 0x80) &&
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode &&
-            compare_inode_names(superblock.inode[i].name, name)) {
-            found = i;
-            break;
-        }
+static int write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t put = write(fd, (const char *)buf + done, len - done);
+        if (put == -1 && errno == EINTR) continue;
+        if (put <= 0) return -1;
+        done += put;
     }
+    return 0;
+}
 
-    if (found == -1) {
-        fprintf(stderr, "Error: File %s does not exist\n", name);
-        return;
+// Whether a request names its target as a command file could: one word,
+// of at most 15 bytes for A, and for files and directories a path or a
+// name of at most 5 bytes. Commands without a target ignore the name.
+static int serve_name_ok(char op, const char *name, int len) {
+    if (!strchr("MACDERWY", op)) return 1;
+    if (len == 0 || (int)strlen(name) != len) return 0;
+    for (int i = 0; i < len; i++) {
+        if (isspace((unsigned char)name[i])) return 0;
     }
+    if (op == 'A') return len <= 15;
+    return op == 'M' || len <= 5 || memchr(name, '/', len) != NULL;
+}
 
-    int size = superblock.inode[found].used_size & 0x7F;
-    if (block_num < 0 || block_num >= size) {
-        fprintf(stderr, "Error: %s does not have block %d\n", name, block_num);
-        return;
+// Run one request and fill in the reply. Returns the first part of its
+// payload, the blocks read or the text printed; the error messages, if
+// any, follow it and are in err_text.
+static const char *serve_request(Server *server, const FsRequest *req, const char *name,
+                                 FsReply *reply) {
+    FsContext *fs = server->fs;
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = (char)req->op;
+    cmd.arg1 = req->arg1;
+    cmd.arg2 = req->arg2;
+    cmd.text = cmd.op == 'B' ? server->payload : name;
+    cmd.text_len = cmd.op == 'B' ? (int)req->payload_len : req->name_len;
+
+    reply->status = FS_REPLY_BAD_REQUEST;
+    reply->payload_len = 0;
+    reply->error_len = 0;
+    if (!cmd.op || !strchr(SERVE_OPS, cmd.op) || !command_args_ok(&cmd) ||
+        !serve_name_ok(cmd.op, name, req->name_len) ||
+        (cmd.op == 'B' && req->payload_len > FS_BLOCK_SIZE) ||
+        (cmd.op == 'W' && req->payload_len > (uint32_t)cmd.arg2 * FS_BLOCK_SIZE)) {
+        return NULL;
     }
 
-    FILE *disk = fopen(current_disk, "r+b");
-    if (!disk) {
-        return;
+    rewind(server->out);
+    rewind(server->err);
+    if (cmd.op == 'W' && req->payload_len > 0) {
+        // A short payload is padded with zeros, as B pads the buffer
+        unsigned long started = collect_stats ? clock_ns() : 0;
+        memset(server->payload + req->payload_len, 0, 
+               cmd.arg2 * FS_BLOCK_SIZE - req->payload_len);
+        fs_write_blocks(fs, name, cmd.arg1, cmd.arg2, server->payload);
+        count_command(fs, 'W', collect_stats ? clock_ns() - started : 0);
+    } else {
+        // R reads into the buffer and W without payload writes from it, as
+        // in a command file
+        run_command(fs, &cmd, "request");
     }
+    fflush(server->out);
+    fflush(server->err);
 
-    // Calculate actual block position and write
-    int actual_block = superblock.inode[found].start_block + block_num;
-    fseek(disk, actual_block * 1024, SEEK_SET);
-    fwrite(buffer, 1024, 1, disk);
-    fclose(disk);
+    reply->error_len = server->err_len;
+    reply->status = server->err_len > 0 ? FS_REPLY_ERROR : FS_REPLY_OK;
+    if (cmd.op == 'R' && reply->status == FS_REPLY_OK) {
+        reply->payload_len = cmd.arg2 * FS_BLOCK_SIZE;
+        return fs->buffer;
+    }
+    reply->payload_len = server->out_len + server->err_len;
+    return server->out_text;
 }
 
-void fs_buff(char buff[1024]) {
-    memset(buffer, 0, 1024); 
-    if (buff) {
-        strncpy(buffer, buff, 1024);
+// Serve requests until the input ends. A frame that cannot be read in
+// full, or whose payload is too large to take, ends it too, since the
+// stream can no longer be trusted to be in step.
+static void serve_stream(Server *server, int in_fd, int out_fd) {
+    FsRequest req;
+    char name[256];
+    while (!serve_stop && read_full(in_fd, &req, sizeof(req)) == 1) {
+        FsReply reply = { FS_REPLY_BAD_REQUEST, 0, 0 };
+        if (req.payload_len > SERVE_PAYLOAD_MAX) {
+            write_full(out_fd, &reply, sizeof(reply));
+            return;
+        }
+        if (read_full(in_fd, name, req.name_len) != 1 ||
+            read_full(in_fd, server->payload, req.payload_len) != 1) {
+            return;
+        }
+        name[req.name_len] = '\0';
+
+        const char *data = serve_request(server, &req, name, &reply);
+        if (write_full(out_fd, &reply, sizeof(reply)) == -1 ||
+            write_full(out_fd, data, reply.payload_len - reply.error_len) == -1 ||
+            write_full(out_fd, server->err_text, reply.error_len) == -1) {
+            return;
+        }
+
+        // The time until the next request is when compaction runs
+        fs_compact_step(server->fs);
     }
 }
 
-void fs_ls(void) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
-    }
+static int listen_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
 
-    // Count valid entries in current directory
-    int current_items = 0;
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode) {
-            current_items++;
-        }
+    // A socket left behind by an earlier server is replaced
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    // Print current directory
-    printf("%-5s %3d\n", ".", current_items + 2);
+// Serve on socket_path, or on standard input and output for "-", until
+// the input ends or the server is interrupted
+static int run_server(const char *socket_path) {
+    Server *server = calloc(1, sizeof(Server));
+    if (!server) {
+        fprintf(stderr, "Error: Not enough memory to serve requests\n");
+        return 1;
+    }
+    server->out = open_memstream(&server->out_text, &server->out_len);
+    server->err = open_memstream(&server->err_text, &server->err_len);
+    server->fs = server->out && server->err ? fs_new(server->out, server->err) : NULL;
 
-    // Print parent directory
-    if (current_dir_inode == 0) {
-        printf("%-5s %3d\n", "..", current_items + 2);
+    int status = 0;
+    int listen_fd = -1;
+    if (!server->fs) {
+        fprintf(stderr, "Error: Cannot allocate a %d block cache\n", cache_blocks);
+        status = 1;
+    } else if (strcmp(socket_path, "-") != 0 && (listen_fd = listen_socket(socket_path)) == -1) {
+        fprintf(stderr, "Error: Cannot listen on %s\n", socket_path);
+        status = 1;
     } else {
-        int parent_idx = superblock.inode[current_dir_inode].dir_parent & 0x7F;
-        int parent_items = 0;
-        for (int i = 0; i < 126; i++) {
-            if ((superblock.inode[i].used_size & 0x80) && 
-                (superblock.inode[i].dir_parent & 0x7F) == parent_idx) {
-                parent_items++;
+        // No SA_RESTART, so a signal interrupts a blocked accept or read
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stop_serving;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        if (listen_fd == -1) {
+            serve_stream(server, STDIN_FILENO, STDOUT_FILENO);
+        }
+        while (listen_fd != -1 && !serve_stop) {
+            int conn = accept(listen_fd, NULL, NULL);
+            if (conn == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                fprintf(stderr, "Error: Cannot accept on %s\n", socket_path);
+                status = 1;
+                break;
             }
+            serve_stream(server, conn, conn);
+            close(conn);
+        }
+        if (listen_fd != -1) {
+            close(listen_fd);
+            unlink(socket_path);
         }
-        printf("%-5s %3d\n", "..", parent_items + 2);
     }
 
-    // Print all other entries
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode) {
-            if (superblock.inode[i].dir_parent & 0x80) { // Directory
-                int dir_items = 0;
-                for (int j = 0; j < 126; j++) {
-                    if ((superblock.inode[j].used_size & 0x80) && 
-                        (superblock.inode[j].dir_parent & 0x7F) == i) {
-                        dir_items++;
-                    }
-                }
-                printf("%-5s %3d\n", superblock.inode[i].name, dir_items + 2);
-            } else { // File
-                printf("%-5s %3d KB\n", superblock.inode[i].name, 
-                       superblock.inode[i].used_size & 0x7F);
-            }
+    if (server->fs) {
+        if (collect_stats) {
+            unmount_disk(server->fs);
+            print_stats(server->fs, stderr);
         }
+        fs_free(server->fs);
     }
+    if (server->out) fclose(server->out);
+    if (server->err) fclose(server->err);
+    free(server->out_text);
+    free(server->err_text);
+    free(server);
+    return status;
 }
 
-void fs_resize(char name[5], int new_size) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
-    }
+// Benchmark mode: every fs_* operation is timed on disks created in a
+// scratch directory, and each benchmark prints one JSON line. The options
+// in effect (cache, journal, extents, ...) apply as they would to a
+// command file, so runs with different options can be compared directly.
+#define BENCH_TREE_DEPTH 512   // Deepest directory chain for delete_tree
+#define BENCH_IO_BLOCKS 1024   // Most blocks read or written per round
 
-    // Find the file
-    int found = -1;
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            !(superblock.inode[i].dir_parent & 0x80) &&
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode &&
-            compare_inode_names(superblock.inode[i].name, name)) {
-            found = i;
-            break;
-        }
-    }
+typedef struct {
+    double *seconds;           // Latency of each timed operation
+    int count;
+    int capacity;
+} BenchSeries;
 
-    if (found == -1) {
-        fprintf(stderr, "Error: File %s does not exist\n", name);
-        return;
+typedef struct {
+    char dir[PATH_MAX - 16];   // Scratch directory holding the images, leaving room for their names
+    int rounds;
+    FILE *out;                 // Listings are timed but not kept
+    FILE *err;                 // Diagnostics, counted as errors per benchmark
+    char *err_text;
+    size_t err_len;
+    size_t err_seen;
+    BenchSeries series;
+    double started;
+} Bench;
+
+static double bench_clock(void) {
+    return clock_ns() / 1e9;
+}
+
+static void bench_start(Bench *bench) {
+    bench->started = bench_clock();
+}
+
+static void bench_stop(Bench *bench) {
+    double elapsed = bench_clock() - bench->started;
+    BenchSeries *series = &bench->series;
+    if (series->count == series->capacity) {
+        int capacity = series->capacity ? series->capacity * 2 : 1024;
+        double *seconds = realloc(series->seconds, capacity * sizeof(double));
+        if (!seconds) return;
+        series->seconds = seconds;
+        series->capacity = capacity;
     }
+    series->seconds[series->count++] = elapsed;
+}
 
-    int current_size = superblock.inode[found].used_size & 0x7F;
-    int start_block = superblock.inode[found].start_block;
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
 
-    if (new_size > current_size) {
-        // Try to expand in place
-        int can_expand = 1;
-        for (int i = start_block + current_size; i < start_block + new_size && can_expand; i++) {
-            if (i >= 128 || get_block_bit(i)) {
-                can_expand = 0;
-            }
-        }
+// Nearest-rank percentile of sorted samples, in microseconds
+static double bench_percentile(const BenchSeries *series, double p) {
+    int rank = (int)(p * series->count + 0.999999);
+    if (rank < 1) rank = 1;
+    return series->seconds[rank - 1] * 1e6;
+}
 
-        if (!can_expand) {
-            // Find new location
-            int new_start = find_contiguous_blocks(new_size);
-            if (new_start == -1) {
-                fprintf(stderr, "Error: File %s cannot expand to size %d\n", name, new_size);
-                return;
-            }
+// Print the samples taken since the last report and start a new series.
+// Any diagnostic the file system printed meanwhile counts as an error.
+static void bench_report(Bench *bench, const char *name) {
+    BenchSeries *series = &bench->series;
+    fflush(bench->err);
+    int errors = 0;
+    for (size_t i = bench->err_seen; i < bench->err_len; i++) {
+        errors += bench->err_text[i] == '\n';
+    }
+    bench->err_seen = bench->err_len;
 
-            // Copy data to new location
-            FILE *disk = fopen(current_disk, "r+b");
-            if (disk) {
-                char block[1024];
-                // Copy existing blocks
-                for (int i = 0; i < current_size; i++) {
-                    fseek(disk, (start_block + i) * 1024, SEEK_SET);
-                    fread(block, 1024, 1, disk);
-                    fseek(disk, (new_start + i) * 1024, SEEK_SET);
-                    fwrite(block, 1024, 1, disk);
-                }
+    double total = 0;
+    for (int i = 0; i < series->count; i++) total += series->seconds[i];
+    qsort(series->seconds, series->count, sizeof(double), compare_doubles);
+    printf("{\"bench\":\"%s\",\"ops\":%d,\"errors\":%d", name, series->count, errors);
+    if (series->count > 0) {
+        printf(",\"ops_per_sec\":%.1f,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,"
+               "\"p99_us\":%.3f,\"max_us\":%.3f",
+               total > 0 ? series->count / total : 0.0, total / series->count * 1e6,
+               bench_percentile(series, 0.5), bench_percentile(series, 0.9),
+               bench_percentile(series, 0.99), series->seconds[series->count - 1] * 1e6);
+    }
+    printf("}\n");
+    fflush(stdout);
+    series->count = 0;
+}
 
-                // Zero out old blocks
-                memset(block, 0, 1024);
-                for (int i = 0; i < current_size; i++) {
-                    fseek(disk, (start_block + i) * 1024, SEEK_SET);
-                    fwrite(block, 1024, 1, disk);
-                }
-                fclose(disk);
+// Distinct 5-character names: a prefix and i in base 36
+static void bench_name(char name[6], char prefix, int i) {
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    name[0] = prefix;
+    for (int k = 4; k >= 1; k--) {
+        name[k] = digits[i % 36];
+        i /= 36;
+    }
+    name[5] = '\0';
+}
 
-                // Update block allocation
-                for (int i = 0; i < current_size; i++) {
-                    set_block_bit(start_block + i, 0);  // Free old blocks
-                }
-                for (int i = 0; i < new_size; i++) {
-                    set_block_bit(new_start + i, 1);  // Mark new blocks as used
-                }
+// Write an empty image holding the directory the benchmarks work in. Root
+// lookups only see entries whose parent is inode 0, so the work directory
+// hangs off directory inode 0 rather than off the root.
+static void bench_image(Bench *bench, const char *image, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s/%s", bench->dir, image);
+    Superblock *superblock = malloc(sizeof(Superblock));
+    if (!superblock) return;
+    format_superblock(superblock);
+    memcpy(superblock->inode[0].name, "top", 4);
+    superblock->inode[0].used_size = INODE_FLAG;
+    superblock->inode[0].dir_parent = INODE_FLAG | ROOT_PARENT;
+    memcpy(superblock->inode[1].name, "bench", 5);
+    superblock->inode[1].used_size = INODE_FLAG;
+    superblock->inode[1].dir_parent = INODE_FLAG | 0;
 
-                superblock.inode[found].start_block = new_start;
-            }
-        } else {
-            // Mark additional blocks as used
-            for (int i = current_size; i < new_size; i++) {
-                set_block_bit(start_block + i, 1);
-            }
-        }
-    } else if (new_size < current_size) {
-        // Shrink file
-        FILE *disk = fopen(current_disk, "r+b");
-        if (disk) {
-            char zero_block[1024] = {0};
-            for (int i = new_size; i < current_size; i++) {
-                fseek(disk, (start_block + i) * 1024, SEEK_SET);
-                fwrite(zero_block, 1024, 1, disk);
-                set_block_bit(start_block + i, 0);  
-            }
-            fclose(disk);
-        }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        (void)!ftruncate(fd, DISK_BYTES);
+        (void)!pwrite(fd, superblock, sizeof(Superblock), 0);
+        close(fd);
     }
+    free(superblock);
+}
 
-    // Update inode size
-    superblock.inode[found].used_size = 0x80 | (new_size & 0x7F);
-    write_superblock();
+// A context with path mounted and the work directory current
+static FsContext *bench_open(Bench *bench, char *path) {
+    FsContext *fs = fs_new(bench->out, bench->err);
+    if (!fs) return NULL;
+    fs_mount(fs, path);
+    fs_cd(fs, "bench");
+    return fs;
 }
 
-void fs_defrag(void) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
+// Fill the work directory with 1-block files, as many as inodes and blocks allow
+static int bench_fill(FsContext *fs) {
+    int files = FS_INODE_COUNT - 2 < DATA_BLOCKS ? FS_INODE_COUNT - 2 : DATA_BLOCKS;
+    char name[6];
+    for (int i = 0; i < files; i++) {
+        bench_name(name, 'f', i);
+        fs_create(fs, name, 1);
     }
+    return files;
+}
 
-    // Create sorted array of files
-    typedef struct {
-        int inode_idx;
-        int start_block;
-        int size;
-    } FileInfo;
-    
-    FileInfo files[126];
-    int file_count = 0;
+static void bench_mount(Bench *bench) {
+    char path[PATH_MAX];
+    bench_image(bench, "full", path);
+    FsContext *fs = bench_open(bench, path);
+    if (!fs) return;
+    bench_fill(fs);
+    fs_sync(fs);
 
-    // Collect file information
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) && 
-            !(superblock.inode[i].dir_parent & 0x80)) {
-            files[file_count].inode_idx = i;
-            files[file_count].start_block = superblock.inode[i].start_block;
-            files[file_count].size = superblock.inode[i].used_size & 0x7F;
-            file_count++;
-        }
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_start(bench);
+        fs_mount(fs, path);
+        bench_stop(bench);
+    }
+    bench_report(bench, "mount");
+
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_start(bench);
+        if (check_consistency(fs) != 0) fprintf(bench->err, "Error: Benchmark disk is inconsistent\n");
+        bench_stop(bench);
+    }
+    bench_report(bench, "check_consistency");
+
+    fs_cd(fs, "bench");
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_start(bench);
+        fs_ls(fs);
+        bench_stop(bench);
     }
+    bench_report(bench, "ls_full");
+    fs_free(fs);
+}
 
-    // Sort files by start block
-    for (int i = 0; i < file_count - 1; i++) {
-        for (int j = 0; j < file_count - i - 1; j++) {
-            if (files[j].start_block > files[j + 1].start_block) {
-                FileInfo temp = files[j];
-                files[j] = files[j + 1];
-                files[j + 1] = temp;
+static void bench_create_delete(Bench *bench) {
+    char path[PATH_MAX];
+    char name[6];
+    int files = FS_INODE_COUNT - 2 < DATA_BLOCKS ? FS_INODE_COUNT - 2 : DATA_BLOCKS;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int r = 0; r < bench->rounds; r++) {
+            bench_image(bench, "work", path);
+            FsContext *fs = bench_open(bench, path);
+            if (!fs) return;
+            for (int i = 0; i < files; i++) {
+                bench_name(name, 'f', i);
+                if (pass == 0) bench_start(bench);
+                fs_create(fs, name, 1);
+                if (pass == 0) bench_stop(bench);
+            }
+            for (int i = 0; pass == 1 && i < files; i++) {
+                bench_name(name, 'f', i);
+                bench_start(bench);
+                fs_delete(fs, name, -1);
+                bench_stop(bench);
             }
+            fs_free(fs);
         }
+        bench_report(bench, pass == 0 ? "create" : "delete");
     }
+}
 
-    // Move files toward beginning
-    int next_free = 1;  // Start after superblock
-    FILE *disk = fopen(current_disk, "r+b");
-    if (disk) {
-        char *block_buffer = malloc(1024);
-        if (!block_buffer) {
-            fclose(disk);
-            return;
+// A chain of nested directories with a file in each, removed by deleting its top
+static void bench_delete_tree(Bench *bench) {
+    char path[PATH_MAX];
+    char name[6];
+    int depth = (FS_INODE_COUNT - 2) / 2;
+    if (depth > DATA_BLOCKS) depth = DATA_BLOCKS;
+    if (depth > BENCH_TREE_DEPTH) depth = BENCH_TREE_DEPTH;
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_image(bench, "work", path);
+        FsContext *fs = bench_open(bench, path);
+        if (!fs) return;
+        for (int level = 0; level < depth; level++) {
+            bench_name(name, 'f', level);
+            fs_create(fs, name, 1);
+            bench_name(name, 'd', level);
+            fs_create(fs, name, 0);
+            fs_cd(fs, name);
         }
+        fs_mount(fs, path);
+        fs_cd(fs, "bench");
 
-        for (int i = 0; i < file_count; i++) {
-            if (files[i].start_block != next_free) {
-                // Move each block of the file
-                for (int j = 0; j < files[i].size; j++) {
-                    // Read original block
-                    fseek(disk, (files[i].start_block + j) * 1024, SEEK_SET);
-                    fread(block_buffer, 1024, 1, disk);
-                    
-                    // Write to new location
-                    fseek(disk, (next_free + j) * 1024, SEEK_SET);
-                    fwrite(block_buffer, 1024, 1, disk);
-                }
+        bench_name(name, 'd', 0);
+        bench_start(bench);
+        fs_delete(fs, name, -1);
+        bench_stop(bench);
+        fs_free(fs);
+    }
+    bench_report(bench, "delete_tree");
+}
 
-                // Update free space list and zero out old blocks
-                for (int j = 0; j < files[i].size; j++) {
-                    set_block_bit(files[i].start_block + j, 0);
-                    set_block_bit(next_free + j, 1);
-                }
+static void bench_read_write(Bench *bench) {
+    char path[PATH_MAX];
+    int size = MAX_FILE_BLOCKS / 2 > BENCH_IO_BLOCKS ? BENCH_IO_BLOCKS : MAX_FILE_BLOCKS / 2;
+    if (size < 1) size = 1;
+    bench_image(bench, "work", path);
+    FsContext *fs = bench_open(bench, path);
+    if (!fs) return;
+    char text[1024] = "benchmark block contents";
+    fs_create(fs, "data", size);
+    fs_buff(fs, text);
 
-                // Zero out old blocks
-                memset(block_buffer, 0, 1024);
-                for (int j = 0; j < files[i].size; j++) {
-                    fseek(disk, (files[i].start_block + j) * 1024, SEEK_SET);
-                    fwrite(block_buffer, 1024, 1, disk);
-                }
+    for (int r = 0; r < bench->rounds; r++) {
+        for (int b = 0; b < size; b++) {
+            bench_start(bench);
+            fs_write(fs, "data", b);
+            bench_stop(bench);
+        }
+    }
+    bench_report(bench, "write");
 
-                // Update inode
-                superblock.inode[files[i].inode_idx].start_block = next_free;
-            }
-            next_free += files[i].size;
+    for (int r = 0; r < bench->rounds; r++) {
+        for (int b = 0; b < size; b++) {
+            bench_start(bench);
+            fs_read(fs, "data", b);
+            bench_stop(bench);
         }
+    }
+    bench_report(bench, "read");
 
-        free(block_buffer);
-        fclose(disk);
-        write_superblock();
+    int count = size < MAX_RANGE_BLOCKS ? size : MAX_RANGE_BLOCKS;
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_start(bench);
+        fs_write_range(fs, "data", 0, count);
+        bench_stop(bench);
     }
-}
+    bench_report(bench, "write_range");
 
-void fs_cd(char name[5]) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_start(bench);
+        fs_read_range(fs, "data", 0, count);
+        bench_stop(bench);
     }
+    bench_report(bench, "read_range");
+    fs_free(fs);
+}
 
-    if (strcmp(name, ".") == 0) {
-        return;  
+// Growing a file that another one sits right behind moves it
+static void bench_resize(Bench *bench) {
+    char path[PATH_MAX];
+    int size = DATA_BLOCKS / 4 < MAX_FILE_BLOCKS / 2 ? DATA_BLOCKS / 4 : MAX_FILE_BLOCKS / 2;
+    if (size < 1) size = 1;
+    bench_image(bench, "work", path);
+    FsContext *fs = bench_open(bench, path);
+    if (!fs) return;
+    for (int r = 0; r < bench->rounds; r++) {
+        fs_create(fs, "grow", size);
+        fs_create(fs, "wall", 1);
+        bench_start(bench);
+        fs_resize(fs, "grow", size * 2);
+        bench_stop(bench);
+        fs_delete(fs, "grow", -1);
+        fs_delete(fs, "wall", -1);
     }
-    
-    if (strcmp(name, "..") == 0) {
-        if (current_dir_inode != 0) {  // Not root directory
-            int parent = superblock.inode[current_dir_inode].dir_parent & 0x7F;
-            if (parent != 127) {  // Not root
-                current_dir_inode = parent;
-            }
+    bench_report(bench, "resize_move");
+    fs_free(fs);
+}
+
+// Worst case for defrag: every other block free, so every file moves
+static void bench_defrag(Bench *bench) {
+    char path[PATH_MAX];
+    char name[6];
+    for (int r = 0; r < bench->rounds; r++) {
+        bench_image(bench, "work", path);
+        FsContext *fs = bench_open(bench, path);
+        if (!fs) return;
+        int files = bench_fill(fs);
+        for (int i = 0; i < files; i += 2) {
+            bench_name(name, 'f', i);
+            fs_delete(fs, name, -1);
         }
-        return;
+        bench_start(bench);
+        fs_defrag(fs);
+        bench_stop(bench);
+        fs_free(fs);
     }
+    bench_report(bench, "defrag");
+}
 
-    // Find directory in current directory
-    int found = -1;
-    for (int i = 0; i < 126; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&  // Used inode
-            (superblock.inode[i].dir_parent & 0x80) &&  // Is a directory
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode &&  // In current directory
-            compare_inode_names(superblock.inode[i].name, name)) {
-            found = i;
-            break;
-        }
+static int run_benchmarks(int rounds) {
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.rounds = rounds;
+    const char *tmp = getenv("TMPDIR");
+    snprintf(bench.dir, sizeof(bench.dir), "%s/fs-bench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(bench.dir)) {
+        fprintf(stderr, "Error: Cannot create a scratch directory for benchmarks\n");
+        return 1;
+    }
+    bench.out = fopen("/dev/null", "w");
+    bench.err = open_memstream(&bench.err_text, &bench.err_len);
+    if (!bench.out || !bench.err) {
+        fprintf(stderr, "Error: Cannot open benchmark output streams\n");
+        return 1;
     }
 
-    if (found == -1) {
-        fprintf(stderr, "Error: Directory %s does not exist\n", name);
-        return;
+    printf("{\"bench\":\"config\",\"block_size\":%d,\"block_count\":%d,\"inode_count\":%d,"
+           "\"rounds\":%d}\n", FS_BLOCK_SIZE, FS_BLOCK_COUNT, FS_INODE_COUNT, rounds);
+    bench_mount(&bench);
+    bench_create_delete(&bench);
+    bench_delete_tree(&bench);
+    bench_read_write(&bench);
+    bench_resize(&bench);
+    bench_defrag(&bench);
+
+    // Unmounting removed any journals, so only the images are left
+    const char *images[] = {"full", "work"};
+    char path[PATH_MAX];
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", bench.dir, images[i]);
+        unlink(path);
     }
+    rmdir(bench.dir);
 
-    current_dir_inode = found;
+    fclose(bench.out);
+    fclose(bench.err);
+    int failed = bench.err_len > 0;
+    if (failed) fwrite(bench.err_text, 1, bench.err_len, stderr);
+    free(bench.err_text);
+    free(bench.series.seconds);
+    return failed;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <command_file>\n", argv[0]);
+// Write an empty file system of the compiled geometry to each image,
+// replacing whatever it held
+static int format_disks(char **disk_paths, int count) {
+    Superblock *superblock = malloc(sizeof(Superblock));
+    if (!superblock) {
+        fprintf(stderr, "Error: Not enough memory to format disks\n");
         return 1;
     }
+    format_superblock(superblock);
 
-    FILE *cmd_file = fopen(argv[1], "r");
-    if (!cmd_file) {
-        fprintf(stderr, "Error: Cannot open command file %s\n", argv[1]);
-        return 1;
+    int status = 0;
+    for (int k = 0; k < count; k++) {
+        int fd = open(disk_paths[k], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, DISK_BYTES) == -1 ||
+            pwrite(fd, superblock, sizeof(Superblock), 0) != (ssize_t)sizeof(Superblock)) {
+            fprintf(stderr, "Error: Cannot format disk %s\n", disk_paths[k]);
+            status = 1;
+        }
+        if (fd != -1) close(fd);
     }
+    free(superblock);
+    return status;
+}
 
-    char line[1024];
-    int line_num = 0;
-    
-    while (fgets(line, sizeof(line), cmd_file)) {
-        line_num++;
-        line[strcspn(line, "\n")] = 0; // Remove newline
-        if (line[0] == '\0') continue; // Skip empty lines
-
-        char cmd = line[0];
-        char args[1024];
-        
-        if (strlen(line) > 2) {
-            strcpy(args, line + 2);
-        } else {
-            args[0] = '\0';
-        }
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"write-through", no_argument, NULL, 'w'},
+        {"mmap", no_argument, NULL, 'm'},
+        {"trust-clean", no_argument, NULL, 'c'},
+        {"alloc", required_argument, NULL, 'a'},
+        {"lazy-zero", no_argument, NULL, 'z'},
+        {"cache", required_argument, NULL, 'C'},
+        {"batch", no_argument, NULL, 'b'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"journal", no_argument, NULL, 'J'},
+        {"extents", no_argument, NULL, 'x'},
+        {"format", no_argument, NULL, 'F'},
+        {"bench", required_argument, NULL, 'B'},
+        {"stats", no_argument, NULL, 's'},
+        {"holes", no_argument, NULL, 'H'},
+        {"serve", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0}
+    };
 
-        switch (cmd) {
-            case 'M': {  // Mount
-                char disk_name[256];
-                if (sscanf(args, "%s", disk_name) != 1) {
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                    continue;
-                }
-                fs_mount(disk_name);
+    int jobs = 1;
+    int format = 0;
+    int bench_rounds = 0;
+    const char *socket_path = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "wmca:zC:bj:uJxFB:sHd:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                write_through = 1;
                 break;
-            }
-
-            case 'C':  // Create
-                {
-                    char name[6];  // Extra byte for null terminator
-                    int size;
-                    if (sscanf(line, "C %5s %d", name, &size) != 2 || 
-                        size < 0 || size > 127 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_create(name, size);
-                }
+            case 'm':
+                use_mmap = 1;
                 break;
-
-            case 'D':  // Delete
-                {
-                    char name[6];
-                    if (sscanf(line, "D %5s", name) != 1 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_delete(name, -1);
-                }
+            case 'c':
+                trust_clean = 1;
                 break;
-
-            case 'R':  // Read
-                {
-                    char name[6];
-                    int block;
-                    if (sscanf(line, "R %5s %d", name, &block) != 2 || 
-                        block < 0 || block > 126 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_read(name, block);
+            case 'a':
+                if (parse_alloc_policy(optarg) == -1) {
+                    fprintf(stderr, "Error: Unknown allocation policy %s\n", optarg);
+                    return 1;
                 }
+                default_alloc_policy = parse_alloc_policy(optarg);
                 break;
-
-            case 'W':  // Write
-                {
-                    char name[6];
-                    int block;
-                    if (sscanf(line, "W %5s %d", name, &block) != 2 || 
-                        block < 0 || block > 126 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_write(name, block);
-                }
+            case 'z':
+                lazy_zero = 1;
                 break;
-
-            case 'B':  // Buffer
-                {
-                    if (strlen(line) < 2) {  // Just "B" 
-                        memset(buffer, 0, 1024);
-                    } else {
-                        char *buffer_content = line + 2;  // Skip "B "
-                        if (strlen(buffer_content) > 1024) {
-                            fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                            continue;
-                        }
-                        fs_buff(buffer_content);
-                    }
+            case 'C':
+                cache_blocks = atoi(optarg);
+                if (cache_blocks < 0 || cache_blocks > FS_BLOCK_COUNT) {
+                    fprintf(stderr, "Error: Cache size must be 0-%d blocks\n", FS_BLOCK_COUNT);
+                    return 1;
                 }
                 break;
-
-            case 'L':  // List
-                if (strlen(line) != 1) {
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                    continue;
-                }
-                fs_ls();
+            case 'b':
+                batch_mode = 1;
                 break;
-
-            case 'E':  // Resize
-                {
-                    char name[6];
-                    int new_size;
-                    if (sscanf(line, "E %5s %d", name, &new_size) != 2 || 
-                        new_size <= 0 || new_size > 127 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_resize(name, new_size);
-                }
+            case 'u':
+                use_io_uring = 1;
                 break;
-
-            case 'O':  // Defragment
-                if (strlen(line) != 1) {
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                    continue;
+            case 'J':
+                use_journal = 1;
+                break;
+            case 'x':
+                use_extents = 1;
+                break;
+            case 'F':
+                format = 1;
+                break;
+            case 's':
+                collect_stats = 1;
+                break;
+            case 'H':
+                use_holes = 1;
+                break;
+            case 'd':
+                socket_path = optarg;
+                break;
+            case 'B':
+                bench_rounds = atoi(optarg);
+                if (bench_rounds < 1) {
+                    fprintf(stderr, "Error: Benchmark rounds must be at least 1\n");
+                    return 1;
                 }
-                fs_defrag();
                 break;
-
-            case 'Y':  // Change directory
-                {
-                    char name[6];
-                    if (sscanf(line, "Y %5s", name) != 1 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_cd(name);
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1) {
+                    fprintf(stderr, "Error: Job count must be at least 1\n");
+                    return 1;
                 }
                 break;
-
             default:
-                fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                break;
+                fprintf(stderr, "Usage: %s [-w] [-m] [-c] [-z] [-a first|best|next] [-C blocks] [-b] [-u] [-J] [-x] [-H] [-s] [-j jobs] <command_file>...\n       %s [options] -d <socket|->\n       %s -F <disk>...\n       %s -B <rounds>\n", argv[0], argv[0], argv[0], argv[0]);
+                return 1;
         }
     }
 
-    fclose(cmd_file);
-    if (current_disk) {
-        free(current_disk);
+    if (bench_rounds > 0) return run_benchmarks(bench_rounds);
+    if (socket_path) return run_server(socket_path);
+
+    int count = argc - optind;
+    if (count < 1) {
+        fprintf(stderr, "Usage: %s [-w] [-m] [-c] [-z] [-a first|best|next] [-C blocks] [-b] [-u] [-J] [-x] [-H] [-s] [-j jobs] <command_file>...\n       %s [options] -d <socket|->\n       %s -F <disk>...\n       %s -B <rounds>\n", argv[0], argv[0], argv[0], argv[0]);
+        return 1;
     }
-    return 0;
-}
\ No newline at end of file
+
+    if (format) return format_disks(argv + optind, count);
+
+    // A single stream writes straight to stdout and stderr
+    if (count == 1) return run_stream(argv[optind], stdout, stderr);
+    return replay_parallel(argv + optind, count, jobs < count ? jobs : count);
+}
@@ -1,7 +1,37 @@
+// Disk geometry, fixed at compile time. The defaults give the classic layout
+// of 128 blocks of 1 KB with a one-block superblock of 126 inodes, which
+// builds with byte-wide inode fields and matches images written by older
+// builds. Any other geometry uses wider inode fields and a superblock that
+// starts with a header recording the geometry it was formatted with.
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE 1024
+#endif
+#ifndef FS_BLOCK_COUNT
+#define FS_BLOCK_COUNT 128
+#endif
+#ifndef FS_INODE_COUNT
+#define FS_INODE_COUNT 126
+#endif
+
+#if FS_BLOCK_SIZE == 1024 && FS_BLOCK_COUNT == 128 && FS_INODE_COUNT == 126
+#define FS_CLASSIC 1
+#else
+#define FS_CLASSIC 0
+#endif
+
+#if FS_BLOCK_COUNT % 64 != 0 || FS_BLOCK_SIZE % 512 != 0
+#error "FS_BLOCK_COUNT must be a multiple of 64 and FS_BLOCK_SIZE of 512"
+#endif
+#if FS_BLOCK_COUNT > (1 << 22) || FS_INODE_COUNT < 1 || FS_INODE_COUNT > 65536
+#error "FS_BLOCK_COUNT must be at most 2^22 and FS_INODE_COUNT 1-65536"
+#endif
+
+#if FS_CLASSIC
 typedef struct {
 	char name[5];        // Name of the file/directory (not necessarily null terminated)
 	uint8_t used_size;   // State of inode and size of the file/directory
-	uint8_t start_block; // Index of the first block of the file/directory
+	uint8_t start_block; // Index of the first block of the file/directory, or with
+	                     // bit 7 set the block holding the file's extent map
 	uint8_t dir_parent;  // Type of inode and index of the parent inode
 } Inode;
 
@@ -9,14 +39,105 @@ typedef struct {
 	char free_block_list[16];
 	Inode inode[126];
 } Superblock;
+#else
+// Same fields as the classic inode, with the state and type flags in bit 31
+typedef struct {
+	char name[5];
+	char reserved[3];
+	uint32_t used_size;
+	uint32_t start_block;
+	uint32_t dir_parent;
+} Inode;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t inode_count;
+	uint32_t superblock_blocks; // Blocks taken by the superblock, from block 0
+	uint32_t reserved;
+} SuperblockHeader;
+
+#define FS_SUPERBLOCK_CONTENT \
+	(sizeof(SuperblockHeader) + FS_BLOCK_COUNT / 8 + FS_INODE_COUNT * sizeof(Inode))
+
+// Padded to a whole number of blocks
+typedef struct {
+	SuperblockHeader header;
+	char free_block_list[FS_BLOCK_COUNT / 8];
+	Inode inode[FS_INODE_COUNT];
+	char padding[(FS_SUPERBLOCK_CONTENT + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE * FS_BLOCK_SIZE
+	             - FS_SUPERBLOCK_CONTENT];
+} Superblock;
+#endif
+
+// One simulated file system with its own mounted disk, buffer and caches
+typedef struct FsContext FsContext;
 
-void fs_mount(char *new_disk_name);
-void fs_create(char name[5], int size);
-void fs_delete(char name[5], int inode_idx);
-void fs_read(char name[5], int block_num);
-void fs_write(char name[5], int block_num);
-void fs_buff(char buff[1024]);
-void fs_ls(void);
-void fs_resize(char name[5], int new_size);
-void fs_defrag(void);
-void fs_cd(char name[5]);
\ No newline at end of file
+FsContext *fs_new(FILE *out, FILE *err);
+void fs_free(FsContext *fs);
+void fs_mount(FsContext *fs, char *new_disk_name);
+// Files and directories are named by a name in the current directory or
+// by a path: /a/b/c starts from the directory a mount starts in, a/b from
+// the current one, and . and .. step as with fs_cd. Every component but
+// the last must be a directory, and the last must be a plain name.
+void fs_create(FsContext *fs, const char *path, int size);
+void fs_delete(FsContext *fs, const char *path, int inode_idx);
+void fs_read(FsContext *fs, const char *path, int block_num);
+void fs_write(FsContext *fs, const char *path, int block_num);
+void fs_read_range(FsContext *fs, const char *path, int block_num, int count);
+void fs_write_range(FsContext *fs, const char *path, int block_num, int count);
+// fs_read_blocks and fs_write_blocks take the caller's memory and may be
+// called from several threads at once. The other calls share the context's
+// buffer and current directory.
+void fs_read_blocks(FsContext *fs, const char *path, int block_num, int count, void *data);
+void fs_write_blocks(FsContext *fs, const char *path, int block_num, int count, const void *data);
+void fs_buff(FsContext *fs, char buff[1024]);
+void fs_ls(FsContext *fs);
+void fs_resize(FsContext *fs, const char *path, int new_size);
+void fs_defrag(FsContext *fs);
+void fs_sync(FsContext *fs);
+void fs_scrub(FsContext *fs);
+// A snapshot covers the mounted disk until it is rolled back to,
+// discarded, replaced by a new one, or the disk is unmounted
+void fs_snapshot(FsContext *fs);
+void fs_rollback(FsContext *fs);
+void fs_discard_snapshot(FsContext *fs);
+void fs_alloc(FsContext *fs, char *policy);
+void fs_frag(FsContext *fs);
+// Incremental compaction: each fs_compact_step, run by the command loop
+// between commands, moves up to budget blocks of files down the disk
+// while the fragmentation reported by fs_frag is above threshold percent.
+// A budget of 0 turns it off.
+void fs_compact(FsContext *fs, int budget, int threshold);
+void fs_compact_step(FsContext *fs);
+void fs_stats(FsContext *fs);
+void fs_cd(FsContext *fs, const char *path);
+// Daemon mode (-d) protocol, in host byte order. A request is an FsRequest
+// followed by name_len bytes of name, path, disk name or policy and then
+// payload_len bytes of payload: the data of W, padded with zeros to its
+// block count, or the buffer contents of B. A W without payload writes
+// the buffer. Names follow the rules of command files, so an empty name,
+// or a name of more than 5 bytes that is not a path, is a bad request.
+// The reply is an FsReply followed by payload_len bytes: the blocks read
+// by R, or the text the command printed, and then the last error_len
+// bytes hold its error messages, if any.
+#define FS_REPLY_OK 0
+#define FS_REPLY_ERROR 1         // The command failed; the payload says why
+#define FS_REPLY_BAD_REQUEST 2   // Unknown command, or arguments out of range
+
+typedef struct {
+	uint8_t op;                  // Command letter, as in command files
+	uint8_t name_len;
+	uint16_t reserved;
+	int32_t arg1;                // Size, block number or compaction budget
+	int32_t arg2;                // Block count of R and W, or threshold of G
+	uint32_t payload_len;
+} FsRequest;
+
+typedef struct {
+	int32_t status;
+	uint32_t payload_len;
+	uint32_t error_len;          // Part of the payload holding error messages
+} FsReply;